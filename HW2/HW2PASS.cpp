@@ -13,36 +13,471 @@
 // This pass performs loop invariant code motion, attempting to remove as much
 // code from the body of a loop as possible.  It does this by either hoisting
 // code into the preheader block, or by sinking code to the exit blocks if it is
-// safe.
+// safe. Code only the infrequent path needs is sunk into its blocks as well.
 //
 ////===----------------------------------------------------------------------===//
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/IteratedDominanceFrontier.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/LoopIterator.h"
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/MustExecute.h"
+#include "llvm/Analysis/MemorySSAUpdater.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopPeel.h"
 #include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm/Analysis/BranchProbabilityInfo.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
 
 /* *******Implementation Starts Here******* */
 // include necessary header files
 #include <vector>
 #include <deque>
-#include <map>
-#include <set>
-#include <stack>
 /* *******Implementation Ends Here******* */
 
 using namespace llvm;
 
 #define DEBUG_TYPE "fplicm"
 
+STATISTIC(NumLoops, "Number of loops visited");
+STATISTIC(NumHoisted, "Number of instructions hoisted");
+STATISTIC(NumLoadsHoisted, "Number of loads hoisted");
+STATISTIC(NumFixUps, "Number of fix-up instructions emitted");
+STATISTIC(NumFixUpBlocks, "Number of shared fix-up blocks");
+STATISTIC(NumGuarded, "Number of divisions hoisted behind a guard");
+STATISTIC(NumRaised, "Number of values hoisted out of enclosing loops");
+STATISTIC(NumVersioned, "Number of loops versioned on runtime alias checks");
+STATISTIC(NumSunk, "Number of instructions sunk off the frequent path");
+STATISTIC(NumPromoted, "Number of locations promoted to registers");
+STATISTIC(NumPeeled, "Number of loops peeled to drop a branch on the induction variable");
+STATISTIC(NumStaticGuards, "Number of unprofiled branches weighted by their induction variable");
+STATISTIC(NumSpecialized, "Number of loops specialized on profiled load values");
+STATISTIC(NumOutlined, "Number of cold loop regions outlined");
+STATISTIC(NumPressureLimited, "Number of hoisting candidates kept in the loop for register pressure");
+
+static cl::opt<bool> EnableFPLICMInPipeline(
+    "fplicm-in-pipeline", cl::init(true), cl::Hidden,
+    cl::desc("Add fplicm-performance to the default pipelines, right before "
+             "the loop vectorizer"));
+
+static cl::opt<double> HotPathThreshold(
+    "fplicm-threshold", cl::init(0.8),
+    cl::desc("Probability from which a successor is on the frequent path; "
+             "blocks reached in fewer than 1 - this of the iterations are "
+             "infrequent"));
+
+static cl::opt<unsigned> MaxPeel(
+    "fplicm-max-peel", cl::init(16), cl::Hidden,
+    cl::desc("Before vectorization, peel up to this many iterations off an "
+             "innermost loop whose branch on the induction variable only goes "
+             "one way in its first iterations, like `if (i < 3)`; 0 turns "
+             "this off"));
+
+static cl::opt<unsigned> RegisterLimit(
+    "fplicm-registers", cl::init(0), cl::Hidden,
+    cl::desc("Registers of each class hoisted values may fill up, instead of "
+             "the number the target has; 0 asks the target"));
+
+static cl::opt<unsigned> OutlineMinSize(
+    "fplicm-outline-min-size", cl::init(4), cl::Hidden,
+    cl::desc("Instructions a cold region needs for fplicm-outline to move it "
+             "out of the loop"));
+
+static cl::list<std::string> LoopThresholds(
+    "fplicm-loop-threshold", cl::CommaSeparated,
+    cl::desc("Thresholds of single loops, as function:loop=threshold, with "
+             "the loops of a function numbered in preorder from 0"));
+
+static cl::opt<bool> EnablePromotion(
+    "fplicm-promote", cl::init(true), cl::Hidden,
+    cl::desc("Keep stack slots that are only written on the infrequent path "
+             "in a register for the whole loop"));
+
+static cl::opt<bool> EnableSinking(
+    "fplicm-sink", cl::init(true), cl::Hidden,
+    cl::desc("Sink frequent path computations that are only used on the "
+             "infrequent path or after the loop"));
+
+static cl::opt<bool> EnableVersioning(
+    "fplicm-versioning", cl::init(false), cl::Hidden,
+    cl::desc("Version innermost loops on runtime alias checks when a frequent "
+             "path store may overlap a load that would otherwise be hoisted"));
+
+static cl::opt<bool> EnableStaticGuards(
+    "fplicm-static-guards", cl::init(true), cl::Hidden,
+    cl::desc("Without profile data, weight branches that compare an induction "
+             "variable with a constant, like `if (i < 3)`, by the iterations "
+             "that go each way"));
+
+static cl::opt<std::string> ValueProfileFile(
+    "fplicm-value-profile", cl::value_desc("file"),
+    cl::desc("Value profile that -passes=fplicm-value-prof-use reads, written "
+             "by a program built with -passes=fplicm-value-prof-gen"));
+
+static cl::opt<double> ValueStability(
+    "fplicm-value-stability", cl::init(0.99),
+    cl::desc("Fraction of its runs in which a loop load must read its "
+             "dominant value, for the loop to be specialized on it"));
+
+/// Threshold of a single loop, the way a loop pragma would attach it:
+///   !{!"llvm.loop.fplicm.threshold", double 0.7}
+static const char *ThresholdMD = "llvm.loop.fplicm.threshold";
+
+/// Marks both copies of a versioned loop, so neither is versioned again.
+static const char *VersionedLoopMD = "llvm.loop.fplicm.versioned";
+
+/// Dominant value of a loop load from the value profile, with how often it
+/// was read and how often the load ran:
+///   !{i32 7, i64 hits, i64 total}
+static const char *ValueProfileMD = "fplicm.value";
+
+/// The value an induction variable has in iteration n: Start + n * Step.
+struct Induction {
+    APInt Start;
+    APInt Step;
+};
+
+/// Find the induction \p V is in \p L, from scalar evolution or, in -O0
+/// code, from a stack slot that the loop only writes to add a constant in the
+/// latch. \p V must then be a load of it outside the latch, so it reads the
+/// value before the increment.
+static Optional<Induction> getInduction(Value *V, Loop *L, ScalarEvolution &SE) {
+    if (SE.isSCEVable(V->getType()))
+        if (auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(V)))
+            if (AR->getLoop() == L && AR->isAffine())
+                if (auto *Start = dyn_cast<SCEVConstant>(AR->getStart()))
+                    if (auto *Step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE)))
+                        return Induction{Start->getAPInt(), Step->getAPInt()};
+
+    auto *Load = dyn_cast<LoadInst>(V);
+    auto *Slot = Load ? dyn_cast<AllocaInst>(Load->getPointerOperand()) : nullptr;
+    BasicBlock *Latch = L->getLoopLatch();
+    if (!Slot || !Latch || !L->getLoopPreheader() || !L->contains(Load) || Load->getParent() == Latch)
+        return None;
+    StoreInst *Inc = nullptr;
+    for (auto *U : Slot->users()) {
+        if (isa<LoadInst>(U)) continue;
+        auto *S = dyn_cast<StoreInst>(U);
+        if (!S || S->getPointerOperand() != Slot) return None;
+        if (!L->contains(S)) continue;
+        if (Inc) return None;
+        Inc = S;
+    }
+    auto *Add = Inc ? dyn_cast<BinaryOperator>(Inc->getValueOperand()) : nullptr;
+    if (!Add || Add->getOpcode() != Instruction::Add || Inc->getParent() != Latch || Add->getType() != Load->getType())
+        return None;
+    auto *Old = dyn_cast<LoadInst>(Add->getOperand(0));
+    auto *Step = dyn_cast<ConstantInt>(Add->getOperand(1));
+    if (!Old || Old->getPointerOperand() != Slot || !Step) return None;
+
+    // The start value is the last one stored on the way to the loop.
+    for (BasicBlock *BB = L->getLoopPreheader(); BB; BB = BB->getSinglePredecessor())
+        for (auto &I : reverse(*BB))
+            if (auto *S = dyn_cast<StoreInst>(&I))
+                if (S->getPointerOperand() == Slot) {
+                    if (auto *Start = dyn_cast<ConstantInt>(S->getValueOperand()))
+                        return Induction{Start->getValue(), Step->getValue()};
+                    return None;
+                }
+    return None;
+}
+
+/// How a comparison of an induction variable with a constant goes over the
+/// first iterations of its loop.
+struct GuardProfile {
+    uint64_t Iterations;  // Evaluated, fewer than asked if the variable wraps
+    uint64_t Taken;       // Iterations it holds in
+    uint64_t Changes;     // First iteration it differs from iteration 0 in
+    bool First;           // Its value in iteration 0
+};
+
+/// Evaluate \p Cmp in the iterations [0, N) of \p L. Ordered comparisons
+/// of a variable that does not wrap change once at most, equality holds in
+/// one iteration at most.
+static Optional<GuardProfile> evaluateGuard(ICmpInst *Cmp, Loop *L, ScalarEvolution &SE, uint64_t N) {
+    ICmpInst::Predicate Pred = Cmp->getPredicate();
+    Value *LHS = Cmp->getOperand(0);
+    auto *C = dyn_cast<ConstantInt>(Cmp->getOperand(1));
+    if (!C) {
+        C = dyn_cast<ConstantInt>(LHS);
+        LHS = Cmp->getOperand(1);
+        Pred = ICmpInst::getSwappedPredicate(Pred);
+    }
+    auto Ind = C ? getInduction(LHS, L, SE) : None;
+    if (!Ind || N == 0) return None;
+
+    // Wide enough for Start + n * Step with any 64 bit n.
+    unsigned W = Ind->Start.getBitWidth(), Wide = W + 66;
+    bool Signed = !ICmpInst::isUnsigned(Pred);
+    auto extend = [&](const APInt &V) { return Signed ? V.sext(Wide) : V.zext(Wide); };
+    APInt Start = extend(Ind->Start), Step = Ind->Step.sext(Wide), Bound = extend(C->getValue());
+    if (!Step.isZero()) {
+        APInt Room = Step.isNegative()
+            ? Start - extend(Signed ? APInt::getSignedMinValue(W) : APInt::getMinValue(W))
+            : extend(Signed ? APInt::getSignedMaxValue(W) : APInt::getMaxValue(W)) - Start;
+        APInt Limit = Room.udiv(Step.abs()) + 1;
+        if (Limit.ult(N)) N = Limit.getZExtValue();
+    }
+    auto value = [&](uint64_t n) { return Start + Step * APInt(Wide, n); };
+    auto holds = [&](uint64_t n) { return ICmpInst::compare(value(n), Bound, Pred); };
+
+    GuardProfile G{N, 0, N, holds(0)};
+    if (ICmpInst::isEquality(Pred)) {
+        uint64_t equal = 0;
+        APInt Diff = Bound - Start;
+        if (Step.isZero()) {
+            equal = Diff.isZero() ? N : 0;
+        } else if (Diff.srem(Step).isZero()) {
+            APInt At = Diff.sdiv(Step);
+            if (!At.isNegative() && At.ult(N)) {
+                equal = 1;
+                G.Changes = At.isZero() ? 1 : At.getZExtValue();
+            }
+        }
+        G.Taken = Pred == ICmpInst::ICMP_EQ ? equal : N - equal;
+        return G;
+    }
+    // Monotonic: binary search for the change.
+    uint64_t Lo = 0;
+    while (G.Changes - Lo > 1) {
+        uint64_t Mid = Lo + (G.Changes - Lo) / 2;
+        (holds(Mid) == G.First ? Lo : G.Changes) = Mid;
+    }
+    G.Taken = G.First ? G.Changes : N - G.Changes;
+    return G;
+}
+
+/// The number of iterations of \p L, from scalar evolution or from an exit
+/// test on an induction variable in the header.
+static Optional<uint64_t> getTripCount(Loop *L, ScalarEvolution &SE) {
+    if (unsigned TC = SE.getSmallConstantTripCount(L)) return TC;
+    auto *BI = dyn_cast<BranchInst>(L->getHeader()->getTerminator());
+    auto *Cmp = BI && BI->isConditional() ? dyn_cast<ICmpInst>(BI->getCondition()) : nullptr;
+    if (!Cmp) return None;
+    bool stays = L->contains(BI->getSuccessor(0));
+    if (stays == L->contains(BI->getSuccessor(1))) return None;
+    // The loop runs until the test changes.
+    auto Test = evaluateGuard(Cmp, L, SE, UINT64_MAX);
+    if (!Test || Test->First != stays || Test->Changes == Test->Iterations) return None;
+    return Test->Changes;
+}
+
+/// Without profile data, a branch like `if (i < 3)` in a loop of a billion
+/// iterations looks even to the static heuristics. Give the unweighted
+/// branches of each loop that compare its induction variable with a
+/// constant the fraction of the iterations that go each way.
+static void weightStaticGuards(LoopInfo &LI, ScalarEvolution &SE, BranchProbabilityInfo &BPI) {
+    for (Loop *L : LI.getLoopsInPreorder()) {
+        auto TC = getTripCount(L, SE);
+        if (!TC) continue;
+        for (auto *BB : L->getBlocks()) {
+            auto *BI = dyn_cast<BranchInst>(BB->getTerminator());
+            if (LI.getLoopFor(BB) != L || !BI || !BI->isConditional() || BI->getMetadata(LLVMContext::MD_prof) ||
+                L->isLoopExiting(BB))
+                continue;
+            auto *Cmp = dyn_cast<ICmpInst>(BI->getCondition());
+            auto Guard = Cmp ? evaluateGuard(Cmp, L, SE, *TC) : None;
+            if (!Guard || Guard->Iterations < *TC) continue;
+            auto Taken = BranchProbability::getBranchProbability(Guard->Taken, *TC);
+            SmallVector<BranchProbability, 2> Probs{Taken, Taken.getCompl()};
+            BPI.setEdgeProbability(BB, Probs);
+            ++NumStaticGuards;
+        }
+    }
+}
+
+/// Profile analyses for a loop pass. The loop adaptor only hands them over
+/// for functions with profile data, and cached function analyses may not be
+/// queried from a loop pass, so otherwise they are computed here from the
+/// static branch heuristics, with loop guards weighted by their induction
+/// variable. Instrumented and sample profiles both count as profile data.
+struct ProfileAnalyses {
+    BlockFrequencyInfo *BFI;
+    BranchProbabilityInfo *BPI;
+
+    ProfileAnalyses(Loop &L, LoopStandardAnalysisResults &AR)
+        : ProfileAnalyses(*L.getHeader()->getParent(), AR.LI, AR.DT, AR.SE, AR.TLI, AR.BFI, AR.BPI) {}
+
+    ProfileAnalyses(Function &F, LoopInfo &LI, DominatorTree &DT, ScalarEvolution &SE, TargetLibraryInfo &TLI,
+                    BlockFrequencyInfo *Profiled, BranchProbabilityInfo *ProfiledBP)
+        : BFI(Profiled), BPI(ProfiledBP) {
+        if (!BPI) {
+            OwnedBPI = std::make_unique<BranchProbabilityInfo>(F, LI, &TLI, &DT);
+            BPI = OwnedBPI.get();
+            if (EnableStaticGuards) weightStaticGuards(LI, SE, *BPI);
+        }
+        if (!BFI) {
+            OwnedBFI = std::make_unique<BlockFrequencyInfo>(F, *BPI, LI);
+            BFI = OwnedBFI.get();
+        }
+    }
+
+private:
+    std::unique_ptr<BranchProbabilityInfo> OwnedBPI;
+    std::unique_ptr<BlockFrequencyInfo> OwnedBFI;
+};
+
+/// The loads the value profile covers, numbered in this order: the integer
+/// loads of \p F inside a loop. Instrumentation and use both see the
+/// loop-simplified bitcode, so the numbers match.
+static SmallVector<LoadInst*, 16> getValueProfileSites(Function &F, LoopInfo &LI) {
+    SmallVector<LoadInst*, 16> sites;
+    for (auto &BB : F) {
+        if (!LI.getLoopFor(&BB)) continue;
+        for (auto &I : BB)
+            if (auto *li = dyn_cast<LoadInst>(&I))
+                if (li->isSimple() && li->getType()->isIntegerTy() && li->getType()->getIntegerBitWidth() <= 64)
+                    sites.push_back(li);
+    }
+    return sites;
+}
+
+/// Give the new block \p BB the frequency of the edges into it.
+static void setFrequencyFromEdges(BasicBlock *BB, BlockFrequencyInfo &bfi, BranchProbabilityInfo &bpi) {
+    BlockFrequency freq;
+    for (auto *Pred : predecessors(BB))
+        freq += bfi.getBlockFreq(Pred) * bpi.getEdgeProbability(Pred, BB);
+    bfi.setBlockFreq(BB, freq.getFrequency());
+}
+
+/// \p Fraction with three decimals, for remarks.
+static std::string formatFraction(double Fraction) {
+    std::string str;
+    raw_string_ostream(str) << format("%.3f", Fraction);
+    return str;
+}
+
+/// Report how likely each successor of the branch at the end of \p BB is,
+/// the input the frequent path is chosen from.
+static void remarkBranch(OptimizationRemarkEmitter &ORE, BasicBlock *BB, BranchProbabilityInfo &bpi) {
+    if (BB->getTerminator()->getNumSuccessors() < 2) return;
+    ORE.emit([&]() {
+        OptimizationRemarkAnalysis R(DEBUG_TYPE, "BranchProbability", BB->getTerminator());
+        R << "branch in " << ore::NV("Block", BB->getName()) << ":";
+        for (auto *Succ : successors(BB)) {
+            auto prob = bpi.getEdgeProbability(BB, Succ);
+            R << " " << ore::NV("Successor", Succ->getName()) << " "
+              << ore::NV("Probability", formatFraction((double)prob.getNumerator() / prob.getDenominator()));
+        }
+        return R;
+    });
+}
+
+/// The name -fplicm-loop-threshold knows \p L by: its function, and its
+/// position among the loops of the function in preorder.
+static std::string getLoopName(Loop *L, LoopInfo &LI) {
+    auto Loops = LI.getLoopsInPreorder();
+    auto Pos = std::find(Loops.begin(), Loops.end(), L) - Loops.begin();
+    return (L->getHeader()->getParent()->getName() + ":" + Twine(Pos)).str();
+}
+
+/// The frequent path threshold of \p L: from -fplicm-loop-threshold, then
+/// from its loop metadata, then -fplicm-threshold. \p Source says which.
+static double getThreshold(Loop *L, LoopInfo &LI, StringRef *Source = nullptr) {
+    auto from = [&](StringRef Name, double T) {
+        if (T <= 0 || T > 1) report_fatal_error("FPLICM threshold out of (0, 1] in " + Name);
+        if (Source) *Source = Name;
+        return T;
+    };
+    if (!LoopThresholds.empty()) {
+        std::string Name = getLoopName(L, LI);
+        for (StringRef Entry : LoopThresholds) {
+            auto Split = Entry.rsplit('=');
+            double T;
+            if (Split.first != Name) continue;
+            if (Split.second.getAsDouble(T)) report_fatal_error("Bad -fplicm-loop-threshold entry " + Entry);
+            return from("-fplicm-loop-threshold", T);
+        }
+    }
+    if (auto MD = findStringMetadataForLoop(L, ThresholdMD))
+        if (auto *CFP = mdconst::dyn_extract<ConstantFP>(**MD)) {
+            APFloat T = CFP->getValueAPF();
+            bool Lost;
+            T.convert(APFloat::IEEEdouble(), APFloat::rmNearestTiesToEven, &Lost);
+            return from(ThresholdMD, T.convertToDouble());
+        }
+    return from("-fplicm-threshold", HotPathThreshold);
+}
+
+/// Report the threshold \p L is split by, and under which name to tune it.
+static void remarkThreshold(OptimizationRemarkEmitter &ORE, Loop *L, LoopInfo &LI) {
+    StringRef Source;
+    double T = getThreshold(L, LI, &Source);
+    ORE.emit([&]() {
+        return OptimizationRemarkAnalysis(DEBUG_TYPE, "Threshold", L->getStartLoc(), L->getHeader())
+               << "loop " << ore::NV("Loop", getLoopName(L, LI)) << ": frequent path threshold "
+               << ore::NV("Threshold", formatFraction(T)) << " from " << ore::NV("Source", Source);
+    });
+}
+
+/// Give \p L a preheader and, with \p DedicatedExits, exit blocks that are
+/// only entered from the loop, for pipelines where loop-simplify did not run
+/// first. The new blocks get their frequency from the edges into them.
+/// Returns true if the CFG changed; the preheader may still be missing when
+/// the loop is entered through an indirect branch.
+static bool formLoopShape(Loop *L, DominatorTree &DT, LoopInfo &LI, MemorySSAUpdater *MSSAU,
+                          BlockFrequencyInfo &bfi, BranchProbabilityInfo &bpi, bool DedicatedExits) {
+    if (L->getLoopPreheader() && (!DedicatedExits || L->hasDedicatedExits())) return false;
+
+    auto setFrequency = [&](BasicBlock *BB) { setFrequencyFromEdges(BB, bfi, bpi); };
+    bool lcssa = L->isLCSSAForm(DT);
+    bool changed = false;
+    if (!L->getLoopPreheader()) {
+        if (BasicBlock *PH = InsertPreheaderForLoop(L, &DT, &LI, MSSAU, lcssa)) {
+            setFrequency(PH);
+            changed = true;
+        }
+    }
+    if (DedicatedExits && !L->hasDedicatedExits()) {
+        SmallVector<BasicBlock*, 8> Exits;
+        L->getUniqueExitBlocks(Exits);
+        SmallPtrSet<BasicBlock*, 8> old(Exits.begin(), Exits.end());
+        if (formDedicatedExitBlocks(L, &DT, &LI, MSSAU, lcssa)) {
+            Exits.clear();
+            L->getUniqueExitBlocks(Exits);
+            for (auto *Exit : Exits)
+                if (!old.count(Exit)) setFrequency(Exit);
+            changed = true;
+        }
+    }
+    return changed;
+}
 
 namespace Correctness{
 class OperandInfo {
@@ -50,162 +485,205 @@ public:
 //    OperandInfo() = default;
     explicit OperandInfo(Value *Operand, LoadInst* LI, StoreInst* SI) {
         operand = Operand;
-        loads.push_back(LI);
-        stores.push_back(SI);
+        loads.insert(LI);
+        stores.insert(SI);
     }
 
     void Insert(LoadInst* LI, StoreInst* SI) {
-        if (std::find(loads.begin(), loads.end(), LI) == loads.end())
-            loads.push_back(LI);
-        if (std::find(stores.begin(), stores.end(), SI) == stores.end())
-            stores.push_back(SI);
+        loads.insert(LI);
+        stores.insert(SI);
     }
 
 public:
     Value *operand; // The instruction that defines this operand
-    std::vector<LoadInst*> loads;
-    std::vector<StoreInst*> stores;
+    SmallSetVector<LoadInst*, 4> loads;
+    SmallSetVector<StoreInst*, 4> stores;
 };
 
-struct FPLICMPass : public LoopPass {
-    static char ID;
-    double Threshold = 0.799999;
-    FPLICMPass() : LoopPass(ID) {}
-
-    bool runOnLoop(Loop *L, LPPassManager &LPM) override {
-      BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
-      BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
-      LoopInfo &LoopInfo = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+/// Pass-manager independent implementation, shared by the legacy and the new
+/// pass manager wrappers below.
+struct FPLICMImpl {
+    /// Probabilities are fixed point, so a bit of slack lets 0.8 count as 0.8.
+    double Threshold;
 
+    bool runOnLoop(Loop *L, BlockFrequencyInfo &bfi, BranchProbabilityInfo &bpi, LoopInfo &LoopInfo,
+                   DominatorTree &DT, AAResults &AA) {
       /* *******Implementation Starts Here******* */
 
-      auto BBs = L->getBlocks();
-      BasicBlock *cur = BBs[1];
-      std::set<BasicBlock*> fb;
-      std::set<BasicBlock*> ifb;
-      std::vector<Instruction*> frequent_loads;
-      std::vector<Instruction*> frequent_stores;
-      std::vector<Instruction*> infrequent_stores;
-
-      // Traverse BBs to find frequent path
-      while (cur != BBs[0]) {
-          fb.insert(cur);
+      bool changed = formLoopShape(L, DT, LoopInfo, nullptr, bfi, bpi, /*DedicatedExits=*/false);
+      if (!L->getLoopPreheader()) return changed;
+      ++NumLoops;
+      OptimizationRemarkEmitter ORE(L->getHeader()->getParent());
+      Threshold = getThreshold(L, LoopInfo) - 0.000001;
+      remarkThreshold(ORE, L, LoopInfo);
+
+      BasicBlock *header = L->getHeader();
+      BasicBlock *cur = header;
+      SmallPtrSet<BasicBlock*, 16> fb;
+      SmallPtrSet<BasicBlock*, 16> ifb;
+      DenseMap<Value*, SmallVector<LoadInst*, 2>> frequent_loads; // By pointer
+      SmallPtrSet<Value*, 16> frequent_stores;                    // Pointers
+      std::vector<StoreInst*> infrequent_stores;
+      std::vector<CallBase*> frequent_calls, infrequent_calls;    // That may write memory
+
+      // Follow the likely successor from the header, until the walk is back
+      // at the header through any latch or leaves the loop through any exit
+      while (cur && L->contains(cur) && fb.insert(cur).second) {
           // Check Instructions in current BB
           for (auto &I : *cur) {
-              if (I.getOpcode() == Instruction::Load){
-                  frequent_loads.push_back(&I);
-              }else if (I.getOpcode() == Instruction::Store) {
-                  frequent_stores.push_back(&I);
+              if (auto *li = dyn_cast<LoadInst>(&I)){
+                  frequent_loads[li->getPointerOperand()].push_back(li);
+              }else if (auto *si = dyn_cast<StoreInst>(&I)) {
+                  frequent_stores.insert(si->getPointerOperand());
+              }else if (auto *CB = dyn_cast<CallBase>(&I)) {
+                  if (!CB->onlyReadsMemory()) frequent_calls.push_back(CB);
               }
           }
 
           // Determine where to go next
           auto exit_ins = cur->getTerminator();
           if (exit_ins->getNumSuccessors() > 1){
-              auto ite = successors(cur).begin();
-              BasicBlock *left  = *ite;
-              BasicBlock *right = *(ite+1);
-              double N = bpi.getEdgeProbability(&*cur, left).getNumerator();
-              double p = N / (bpi.getEdgeProbability(&*cur, left).getDenominator());
-              if (p > Threshold) {
-                  cur = left;
-                  ifb.insert(right);
-                  // errs() << *right->getInstList().begin() << "\n";
-              }else if (p < 1 - Threshold){
-                  cur = right;
-                  ifb.insert(left);
-                  // errs() << *left->getInstList().begin() << "\n";
-              }else{
-                  errs() << p << " is less than 0.8 but greater than 0.2!\n";
+              remarkBranch(ORE, cur, bpi);
+              BasicBlock *next = nullptr;
+              for (auto *succ : successors(cur)) {
+                  auto prob = bpi.getEdgeProbability(cur, succ);
+                  if ((double)prob.getNumerator() / prob.getDenominator() > Threshold) next = succ;
+              }
+              if (!next) {
+                  ORE.emit([&]() {
+                      return OptimizationRemarkMissed(DEBUG_TYPE, "NoLikelySuccessor", exit_ins)
+                             << "frequent path ends at " << ore::NV("Block", cur->getName())
+                             << ": no successor is taken more than " << ore::NV("Threshold", formatFraction(Threshold))
+                             << " of the time";
+                  });
                   break;
               }
+              // The other successors inside the loop start infrequent paths
+              for (auto *succ : successors(cur)) {
+                  if (succ != next && succ != header && L->contains(succ)) ifb.insert(succ);
+              }
+              cur = next;
           }else{
               cur = cur->getUniqueSuccessor();
           }
       }
 
       // If no infrequent path
-      if (ifb.empty()) return false;
-
-      // Get infrequent blocks
-      std::deque<BasicBlock*> bfs;
-      for (auto *BB : ifb) {
-          bfs.push_back(BB);
-          while (!bfs.empty()) {
-              // Check Instructions in current BB
-              for (auto &I : *bfs.front()) {
-                  if (I.getOpcode() == Instruction::Store) {
-                      infrequent_stores.push_back(&I);
-                  }
+      if (ifb.empty()) return changed;
+
+      // Get infrequent blocks, each of them once, without leaving the loop
+      std::deque<BasicBlock*> bfs(ifb.begin(), ifb.end());
+      SmallPtrSet<BasicBlock*, 16> visited(ifb.begin(), ifb.end());
+      while (!bfs.empty()) {
+          // Check Instructions in current BB
+          for (auto &I : *bfs.front()) {
+              if (auto *si = dyn_cast<StoreInst>(&I)) {
+                  infrequent_stores.push_back(si);
+              }else if (auto *CB = dyn_cast<CallBase>(&I)) {
+                  if (!CB->onlyReadsMemory()) infrequent_calls.push_back(CB);
               }
-              for (auto *succ : successors(bfs.front())) {
-                  if (std::find(bfs.begin(), bfs.end(), succ) == bfs.end()
-                      && fb.find(succ) == fb.end()){
-                      bfs.push_back(succ);
-                  }
+          }
+          for (auto *succ : successors(bfs.front())) {
+              if (!fb.count(succ) && succ != header && L->contains(succ) && visited.insert(succ).second){
+                  bfs.push_back(succ);
               }
-              bfs.pop_front();
           }
+          bfs.pop_front();
       }
 
-      // Check if we need to do FPLICM
-      std::map<Value*, Correctness::OperandInfo> info;
-      for (auto I : infrequent_stores) {
-          auto operand = I->getOperand(1);
-          for (auto li : frequent_loads) {
-              if (li->getOperand(0) == operand) {
-                  bool dep = false;
-                  for (auto si : frequent_stores) {
-                      if (si->getOperand(1) == operand) {
-                          dep = true;
-                          break;
-                      }
-                  }
-                  if (!dep) {
-                      auto ite = info.find(operand);
-                      if (ite != info.end()) {
-                          ite->second.Insert(dyn_cast<LoadInst>(li), dyn_cast<StoreInst>(I));
-                      }else{
-                          info.insert(ite, std::pair<Value*, Correctness::OperandInfo>(operand, Correctness::OperandInfo(operand, dyn_cast<LoadInst>(li), dyn_cast<StoreInst>(I))));
-                      }
-                  }
+      // Check if we need to do FPLICM: loads of a pointer that is stored to
+      // on the infrequent path only
+      MapVector<Value*, Correctness::OperandInfo> info;
+      for (auto si : infrequent_stores) {
+          auto operand = si->getPointerOperand();
+          auto loads = frequent_loads.find(operand);
+          if (loads == frequent_loads.end()) continue;
+          if (frequent_stores.count(operand)) {
+              for (auto li : loads->second)
+                  ORE.emit([&]() {
+                      return OptimizationRemarkMissed(DEBUG_TYPE, "FrequentStore", li)
+                             << "not hoisted: also stored on the frequent path";
+                  });
+              continue;
+          }
+          for (auto li : loads->second) {
+              auto ite = info.find(operand);
+              if (ite != info.end()) {
+                  ite->second.Insert(li, si);
+              }else{
+                  info.insert(std::make_pair(operand, Correctness::OperandInfo(operand, li, si)));
               }
           }
       }
 
+      // Calls may write the location too. On the frequent path that keeps
+      // the loads in the loop, and so it does on the infrequent path, where
+      // there is no stored value to recompute the fix-ups from.
+      info.remove_if([&](std::pair<Value*, Correctness::OperandInfo> &entry) {
+          auto &loads = entry.second.loads;
+          auto writes = [&](CallBase *CB) {
+              return any_of(loads, [&](LoadInst *li) { return mayWrite(CB, li, AA); });
+          };
+          bool frequent = any_of(frequent_calls, writes);
+          if (!frequent && none_of(infrequent_calls, writes)) return false;
+          for (auto li : loads)
+              ORE.emit([&]() {
+                  return OptimizationRemarkMissed(DEBUG_TYPE, "CallClobber", li)
+                         << "not hoisted: a call on the " << (frequent ? "frequent" : "infrequent")
+                         << " path may write it";
+              });
+          return true;
+      });
+
       // If no instructions need to be hoisted
-      if (info.empty()) return false;
+      if (info.empty()) return changed;
 
       // Analyze FPLICM
-      for (auto ite : info) {
+      for (auto &ite : info) {
+          for (auto load : ite.second.loads)
+              ORE.emit([&]() {
+                  return OptimizationRemark(DEBUG_TYPE, "Hoisted", load)
+                         << "hoisted with " << ore::NV("FixUps", (int64_t)ite.second.stores.size()) << " fix-ups";
+              });
           FPLICM(L->getLoopPreheader(), ite.second);
       }
 
       return true;
   }
 
+    /// Whether \p CB may change the memory \p li reads. Calls marked
+    /// readonly or inaccessiblememonly never do. For the others, alias
+    /// analysis looks at the rest of the callee's attributes, e.g. argmemonly
+    /// calls only write through their pointer arguments, and at whether the
+    /// location escapes to the callee at all.
+    static bool mayWrite(CallBase *CB, LoadInst *li, AAResults &AA) {
+        if (CB->onlyReadsMemory() || CB->onlyAccessesInaccessibleMemory()) return false;
+        return isModSet(AA.getModRefInfo(CB, MemoryLocation::get(li)));
+    }
+
     static void FPLICM(BasicBlock *PreHeader, OperandInfo& info) {
         Instruction *terminator = PreHeader->getTerminator();
         std::vector<Instruction *> ins_list;
 
         for (auto load : info.loads) {
-            auto *cur = dyn_cast<Instruction>(*load->user_begin());
+            auto *cur = load->getNextNode();
             auto prev = load;
             load->moveBefore(terminator);
 
             // Allocate new var on stack ot store post-calculated value.
             auto *var = new AllocaInst(prev->getType(), 0, nullptr, Align(4), "var", terminator);
+            // Insert new load to directly load post-calculated value, where
+            // the load was: its users may be phis, e.g. LCSSA phis of a subloop
+            auto *new_load = new LoadInst(prev->getType(), var, "fix", cur);
+            prev->replaceAllUsesWith(new_load);
             // Insert new store to ins_list
             ins_list.push_back(new StoreInst(prev, var, terminator));
-            // Insert new load to directly load post-calculated value.
-            auto *new_load = new LoadInst(prev->getType(), var, "fix", cur);
-            // Chang specific operand of cur instruction to the post-calculated value
-            cur->setOperand(cur->getOperand(0) == prev ? 0 : 1, new_load);
         }
 
         for (auto store : info.stores) {
-            Instruction *curr, *prev, *origin;
-            origin = dyn_cast<Instruction>(store->getOperand(0));
+            Instruction *curr;
+            Value *prev, *origin;
+            origin = store->getValueOperand();
             prev = origin;
             for (auto I : ins_list) {
                 curr = I->clone();
@@ -225,26 +703,59 @@ struct FPLICMPass : public LoopPass {
                 }
                 curr->insertBefore(store);
             }
-            store->removeFromParent();
-            store->deleteValue();
+            // The store itself stays: code after the loop may read the location
         }
+        NumHoisted += info.loads.size();
+        NumLoadsHoisted += info.loads.size();
+        NumFixUps += info.stores.size() * ins_list.size();
     }
+};
 
+struct FPLICMPass : public LoopPass {
+    static char ID;
+    FPLICMPass() : LoopPass(ID) {}
+
+    bool runOnLoop(Loop *L, LPPassManager &LPM) override {
+      Function &F = *L->getHeader()->getParent();
+      BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+      BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
+      LoopInfo &LoopInfo = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+      DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+      ScalarEvolution &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+      TargetLibraryInfo &TLI = getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(F);
+      AAResults &AA = getAnalysis<AAResultsWrapperPass>().getAAResults();
+      bool profiled = F.hasProfileData();
+      ProfileAnalyses Prof(F, LoopInfo, DT, SE, TLI, profiled ? &bfi : nullptr, profiled ? &bpi : nullptr);
+      return FPLICMImpl().runOnLoop(L, *Prof.BFI, *Prof.BPI, LoopInfo, DT, AA);
+    }
 
     void getAnalysisUsage(AnalysisUsage &AU) const override {
         AU.addRequired<BranchProbabilityInfoWrapperPass>();
         AU.addRequired<BlockFrequencyInfoWrapperPass>();
         AU.addRequired<LoopInfoWrapperPass>();
+        AU.addRequired<DominatorTreeWrapperPass>();
+        AU.addRequired<ScalarEvolutionWrapperPass>();
+        AU.addRequired<TargetLibraryInfoWrapperPass>();
+        AU.addRequired<AAResultsWrapperPass>();
+        AU.addPreserved<LoopInfoWrapperPass>();
+        AU.addPreserved<DominatorTreeWrapperPass>();
     }
+};
 
-private:
-  /// Little predicate that returns true if the specified basic block is in
-  /// a subloop of the current one, not the current one itself.
-    bool inSubLoop(BasicBlock *BB, Loop *CurLoop, LoopInfo *LI) {
-        assert(CurLoop->contains(BB) && "Only valid if BB is IN the loop");
-        return LI->getLoopFor(BB) != CurLoop;
+/// New pass manager version of the correctness pass.
+struct NewFPLICMPass : public PassInfoMixin<NewFPLICMPass> {
+    PreservedAnalyses run(Loop &L, LoopAnalysisManager &AM, LoopStandardAnalysisResults &AR, LPMUpdater &U) {
+        // The rewrite does not update MemorySSA, so stay out of loop-mssa(...)
+        // pipelines rather than hand a stale one to the next pass.
+        if (AR.MSSA) return PreservedAnalyses::all();
+        ProfileAnalyses Prof(L, AR);
+        if (!FPLICMImpl().runOnLoop(&L, *Prof.BFI, *Prof.BPI, AR.LI, AR.DT, AR.AA)) return PreservedAnalyses::all();
+        AR.SE.forgetLoop(&L);
+        return getLoopPassPreservedAnalyses();
     }
 
+    // Run on optnone functions as well, the benchmarks are compiled at -O0.
+    static bool isRequired() { return true; }
 };
 } // end of namespace Correctness
 
@@ -254,341 +765,2027 @@ static RegisterPass<Correctness::FPLICMPass> X("fplicm-correctness", "Frequent L
 
 
 namespace Performance{
-struct FPLICMPass : public LoopPass {
-    static char ID;
-    double Threshold = 0.799999;
-    FPLICMPass() : LoopPass(ID) {}
+/// Loads and stores of the same pointer inside the loop, candidates for
+/// scalar promotion.
+class OperandInfo {
+public:
+    explicit OperandInfo(Value *Operand) : operand(Operand) {}
 
-    bool runOnLoop(Loop *L, LPPassManager &LPM) override {
-        BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
-        BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
-        LoopInfo &LoopInfo = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    void Insert(Instruction *I) {
+        if (auto *li = dyn_cast<LoadInst>(I)) loads.push_back(li);
+        else stores.push_back(cast<StoreInst>(I));
+    }
 
+public:
+    Value *operand; // The pointer all accesses go through
+    std::vector<LoadInst*> loads;
+    std::vector<StoreInst*> stores;
+};
+
+/// The writes of a region of the function, indexed for alias queries. Stores
+/// into an identified object, a stack slot or a global, are bucketed by that
+/// object, and by their byte offset into it when that is a constant;
+/// everything else may write anywhere.
+class WriterIndex {
+public:
+    void add(Instruction *I) {
+        DL = &I->getModule()->getDataLayout();
+        writes.push_back(I);
+        if (auto *si = dyn_cast<StoreInst>(I)) {
+            TypeSize size = DL->getTypeStoreSize(si->getValueOperand()->getType());
+            int64_t offset = 0;
+            const Value *Base = GetPointerBaseWithConstantOffset(si->getPointerOperand(), offset, *DL);
+            if (isIdentifiedObject(Base) && !size.isScalable()) {
+                auto &defs = objects[Base];
+                defs.at.push_back({offset, I});
+                defs.max_size = std::max<int64_t>(defs.max_size, size.getFixedSize());
+                return;
+            }
+            const Value *Obj = getUnderlyingObject(si->getPointerOperand());
+            if (isIdentifiedObject(Obj)) {
+                objects[Obj].anywhere.push_back(I);
+                return;
+            }
+        }
+        unknown.push_back(I);
+    }
+
+    /// Call once all writes are added.
+    void finish() {
+        for (auto &bucket : objects)
+            llvm::stable_sort(bucket.second.at, [](auto &a, auto &b) { return a.first < b.first; });
+    }
+
+    void clear() {
+        DL = nullptr;
+        writes.clear();
+        unknown.clear();
+        objects.clear();
+        cache.clear();
+    }
+
+    /// Every write, in the order they were added.
+    ArrayRef<Instruction*> all() const { return writes; }
+
+    /// The writes that may change \p Loc. Loads of the same location share
+    /// the answer, so alias analysis runs once per location, and only against
+    /// the writes that can reach its bytes: distinct identified objects never
+    /// overlap, and neither do disjoint constant offsets into the same one.
+    const SmallVectorImpl<Instruction*> &get(const MemoryLocation &Loc, AAResults &AA) {
+        auto it = cache.find(Loc);
+        if (it != cache.end()) return it->second;
+        SmallVector<Instruction*, 4> list;
+        auto check = [&](Instruction *I) {
+            if (isModSet(AA.getModRefInfo(I, Loc))) list.push_back(I);
+        };
+        auto checkAll = [&](ObjectDefs &defs) {
+            for (auto &at : defs.at) check(at.second);
+            for (Instruction *I : defs.anywhere) check(I);
+        };
+
+        // Without any write there is no data layout, and nothing to check.
+        if (!DL) return cache[Loc];
+        int64_t offset = 0;
+        const Value *Base = GetPointerBaseWithConstantOffset(Loc.Ptr, offset, *DL);
+        const Value *Obj = getUnderlyingObject(Loc.Ptr);
+        if (isIdentifiedObject(Base) && Loc.Size.hasValue()) {
+            auto bucket = objects.find(Base);
+            if (bucket != objects.end()) {
+                // Sorted by offset: skip the stores that end before Loc does
+                // start, stop at the first one that starts after it ends.
+                auto &defs = bucket->second;
+                int64_t end = offset + Loc.Size.getValue();
+                auto at = llvm::partition_point(defs.at, [&](auto &a) { return a.first + defs.max_size <= offset; });
+                for (; at != defs.at.end() && at->first < end; ++at) check(at->second);
+                for (Instruction *I : defs.anywhere) check(I);
+            }
+        } else if (isIdentifiedObject(Obj)) {
+            auto bucket = objects.find(Obj);
+            if (bucket != objects.end()) checkAll(bucket->second);
+        } else {
+            for (auto &bucket : objects) checkAll(bucket.second);
+        }
+        for (Instruction *I : unknown) check(I);
+        return cache[Loc] = std::move(list);
+    }
+
+private:
+    /// Stores into one identified object.
+    struct ObjectDefs {
+        SmallVector<std::pair<int64_t, Instruction*>, 4> at; // By constant offset, sorted
+        SmallVector<Instruction*, 4> anywhere;               // At a variable offset
+        int64_t max_size = 0;                                 // Widest store in `at`
+    };
+
+    const DataLayout *DL = nullptr;
+    std::vector<Instruction*> writes;
+    std::vector<Instruction*> unknown;                        // May write anything
+    MapVector<const Value*, ObjectDefs> objects;              // By identified object
+    DenseMap<MemoryLocation, SmallVector<Instruction*, 4>> cache;
+};
+
+/// Rewrites the accesses of a promoted location to SSA values, and stores
+/// the value leaving the loop back in every exit block.
+class LoopPromoter : public LoadAndStorePromoter {
+public:
+    LoopPromoter(ArrayRef<const Instruction*> Insts, SSAUpdater &SSA, OperandInfo &info,
+                 SmallVectorImpl<BasicBlock*> &Exits, MemorySSAUpdater &MSSAU)
+        : LoadAndStorePromoter(Insts, SSA), SSA(SSA), info(info), Exits(Exits), MSSAU(MSSAU) {}
+
+    void doExtraRewritesBeforeFinalDeletion() override {
+        StoreInst *first = info.stores.front();
+        for (auto *Exit : Exits) {
+            Value *V = SSA.GetValueInMiddleOfBlock(Exit);
+            auto *store = new StoreInst(V, info.operand, first->isVolatile(), first->getAlign(),
+                                        &*Exit->getFirstInsertionPt());
+            auto *MA = MSSAU.createMemoryAccessInBB(store, nullptr, Exit, MemorySSA::Beginning);
+            MSSAU.insertDef(cast<MemoryDef>(MA), /*RenameUses=*/true);
+        }
+    }
+
+    void instructionDeleted(Instruction *I) const override { MSSAU.removeMemoryAccess(I); }
+
+private:
+    SSAUpdater &SSA;
+    OperandInfo &info;
+    SmallVectorImpl<BasicBlock*> &Exits;
+    MemorySSAUpdater &MSSAU;
+};
+
+/// Pass-manager independent implementation, shared by the legacy and the new
+/// pass manager wrappers below.
+struct FPLICMImpl {
+    /// The loop's threshold, with the same slack as in the correctness pass.
+    double Threshold;
+
+    /// Infrequent writes, in the order they were found.
+    using Writes = SmallSetVector<Instruction*, 4>;
+
+    /// The original loop kept as fallback when the current loop was versioned.
+    Loop *SlowLoop = nullptr;
+
+    FPLICMImpl(AAResults &AA, MemorySSA &MSSA, DominatorTree &DT, ScalarEvolution &SE, TargetLibraryInfo &TLI,
+               const TargetTransformInfo &TTI)
+        : AA(AA), MSSA(MSSA), MSSAU(&MSSA), DT(DT), SE(SE), TLI(TLI), TTI(TTI) {}
+
+    bool runOnLoop(Loop *L, BlockFrequencyInfo &bfi, BranchProbabilityInfo &bpi, LoopInfo &LoopInfo) {
         /* *******Implementation Starts Here******* */
-        auto BBs = L->getBlocks();
-        BasicBlock *cur = BBs[1];
-        std::set<BasicBlock*> fb;
-        std::set<BasicBlock*> ifb;
-        std::vector<Instruction*> frequent_loads;
-        std::vector<Instruction*> frequent_stores;
-        std::vector<Instruction*> infrequent_stores;
-
-        // Traverse BBs to find frequent path
-        while (cur != BBs[0]) {
-            fb.insert(cur);
-            // Check Instructions in current BB
-            for (auto &I : *cur) {
-                if (I.getOpcode() == Instruction::Load){
-                    frequent_loads.push_back(&I);
-                }else if (I.getOpcode() == Instruction::Store) {
-                    frequent_stores.push_back(&I);
+        CurLoop = L;
+        LI = &LoopInfo;
+        BFI = &bfi;
+        BPI = &bpi;
+        // Remarks cannot be cached across loop transformations, so the
+        // emitter is created per loop, like LICM does.
+        OptimizationRemarkEmitter ore(L->getHeader()->getParent());
+        ORE = &ore;
+        fb.clear();
+        ifb.clear();
+        hoisted.clear();
+        clobbers.clear();
+        loop_writers.clear();
+        outer_writers.clear();
+        levels.clear();
+        unguarded.clear();
+        next_iteration.clear();
+        estimates.clear();
+        added = 0;
+        fixup_blocks = 0;
+
+        // Hoisting needs a preheader, promotion and sinking dedicated exits.
+        bool changed = formLoopShape(L, DT, LoopInfo, &MSSAU, bfi, bpi, /*DedicatedExits=*/true);
+        if (!L->getLoopPreheader()) return changed;
+        ++NumLoops;
+        Threshold = getThreshold(L, LoopInfo) - 0.000001;
+        remarkThreshold(ore, L, LoopInfo);
+
+        // Split the loop into a hot region and a cold region by block
+        // frequency, so any branch shape works: switches, multi-way and
+        // indirect branches, and whole subloops.
+        if (!buildRegions(bfi, bpi)) return changed;
+        for (auto *BB : L->getBlocks())
+            if (!getSubLoop(BB)) remarkBranch(ore, BB, bpi);
+
+        // If no infrequent path
+        if (ifb.empty())
+            ORE->emit([&]() {
+                return OptimizationRemarkMissed(DEBUG_TYPE, "NoInfrequentPath", L->getStartLoc(), L->getHeader())
+                       << "no block of the loop runs in less than " << ore::NV("Fraction", formatFraction(1 - Threshold))
+                       << " of its iterations";
+            });
+
+        // Doing constant folding here: forwarding block-local stack slots
+        // first turns values like `temp` in `temp + temp2` into plain SSA
+        // operands the DAG below can follow.
+        BasicBlock *PreHeader = L->getLoopPreheader();
+        for (auto *BB : L->getBlocks())
+            if (fb.count(BB)) changed |= ConstantFolding(BB);
+
+        for (auto *BB : L->getBlocks())
+            if (auto *Defs = MSSA.getBlockDefs(BB))
+                for (auto &MA : *Defs)
+                    if (auto *Def = dyn_cast<MemoryDef>(&MA))
+                        if (!isPureLibCall(Def->getMemoryInst())) loop_writers.add(Def->getMemoryInst());
+        loop_writers.finish();
+
+        // Loads only blocked by frequent path stores that may alias them get
+        // a fast version of the loop, where runtime checks rule that out.
+        bool versioned = EnableVersioning && versionLoop();
+        changed |= versioned;
+        // Loads the value profile found to be stable get a loop specialized
+        // on their values.
+        if (!SlowLoop) changed |= specializeLoop();
+
+        // Without an infrequent path there is nothing to fix up, and only
+        // the loads the runtime checks cleared are left to hoist.
+        if (ifb.empty() && !versioned) return changed;
+
+        // Collect every frequent path instruction whose operands are loop
+        // invariant or hoisted themselves. Reverse post order visits the
+        // operands first, so the list comes out in topological order.
+        SafetyInfo.computeLoopSafetyInfo(L);
+        LoopBlocksRPO RPO(L);
+        RPO.perform(LI);
+        SmallPtrSet<Instruction*, 4> to_guard;
+        for (auto *BB : RPO) {
+            if (!fb.count(BB)) continue;
+            for (auto &I : *BB) {
+                Writes writes;
+                bool guard = false;
+                if (canHoist(&I, writes, guard) && isProfitable(&I, writes, PreHeader)) {
+                    if (guard) to_guard.insert(&I);
+                    hoisted.push_back(&I);
+                    clobbers[&I] = writes;
+                    levels[&I] = L;
                 }
             }
+        }
 
-            // Determine where to go next
-            auto exit_ins = cur->getTerminator();
-            if (exit_ins->getNumSuccessors() > 1){
-                auto ite = successors(cur).begin();
-                BasicBlock *left  = *ite;
-                BasicBlock *right = *(ite+1);
-                double N = bpi.getEdgeProbability(&*cur, left).getNumerator();
-                double p = N / (bpi.getEdgeProbability(&*cur, left).getDenominator());
-                if (p > Threshold) {
-                  cur = left;
-                  ifb.insert(right);
-                  // errs() << *right->getInstList().begin() << "\n";
-                }else if (p < 1 - Threshold){
-                  cur = right;
-                  ifb.insert(left);
-                  // errs() << *left->getInstList().begin() << "\n";
-                }else{
-                      errs() << p << " is less than 0.8 but greater than 0.2!\n";
-                      break;
+        // Each value hoisted and still used in the loop takes a register
+        // across all of it.
+        limitRegisterPressure();
+        for (auto *I : hoisted) {
+            Estimate &E = estimates[I];
+            ORE->emit([&]() {
+                return OptimizationRemark(DEBUG_TYPE, "Hoisted", I)
+                       << "hoisted with " << ore::NV("FixUps", (int64_t)clobbers[I].size())
+                       << " fix-ups, estimated benefit " << ore::NV("Benefit", E.saved - E.cost)
+                       << " (saved " << ore::NV("Saved", E.saved) << ", fix-up cost " << ore::NV("Cost", E.cost)
+                       << ")";
+            });
+        }
+
+        // Only the divisions that leave the loop get their guard, right
+        // before them in the list.
+        for (size_t i = 0; i < hoisted.size(); ++i) {
+            Instruction *I = hoisted[i];
+            if (!to_guard.count(I)) continue;
+            SmallVector<Instruction*, 4> guards;
+            guardDivision(cast<BinaryOperator>(I), guards);
+            Writes writes = clobbers[I];
+            for (auto *G : guards) {
+                clobbers[G] = writes;
+                levels[G] = L;
+                if (next_iteration.count(I)) next_iteration.insert(G);
+            }
+            hoisted.insert(hoisted.begin() + i, guards.begin(), guards.end());
+            i += guards.size();
+            added += guards.size();
+            ++NumGuarded;
+            changed = true;
+        }
+
+        // Values the enclosing loops leave invariant on their frequent paths
+        // as well go further out. Runtime checks only cover this loop.
+        if (!SlowLoop) hoistOutOfNest();
+
+        // Analyze FPLICM
+        if (!hoisted.empty()) {
+            FPLICM();
+            changed = true;
+        }
+
+        // The reverse case: frequent path values that only the infrequent
+        // path or the code after the loop reads are computed there instead.
+        // Runs before promotion, which deletes the loop writes it queries.
+        if (EnableSinking) changed |= sinkColdComputations();
+
+        // What is left of locations that are only written on the infrequent
+        // path, the fix-up reloads included, can live in a register.
+        if (EnablePromotion) changed |= promoteLocations(L->getLoopPreheader());
+        /* *******Implementation Ends Here******* */
+
+        return changed;
+    }
+
+    /// Classify every block of the loop by its frequency relative to the
+    /// header: blocks reached in fewer than 1 - Threshold of the iterations
+    /// form the infrequent region, all others the frequent path. A subloop is
+    /// classified as a whole by how often it is entered, not by its inflated
+    /// per-iteration frequency. Returns false if the loop never runs.
+    bool buildRegions(BlockFrequencyInfo &bfi, BranchProbabilityInfo &bpi) {
+        double header = bfi.getBlockFreq(CurLoop->getHeader()).getFrequency();
+        if (header == 0) return false;
+        double cold = (1 - Threshold) * header;
+
+        DenseMap<Loop*, bool> sub_cold;
+        for (Loop *Sub : CurLoop->getSubLoops()) {
+            double entry = 0;
+            for (auto *Pred : predecessors(Sub->getHeader())) {
+                if (Sub->contains(Pred)) continue;
+                auto prob = bpi.getEdgeProbability(Pred, Sub->getHeader());
+                entry += bfi.getBlockFreq(Pred).getFrequency() * prob.getNumerator() / prob.getDenominator();
+            }
+            sub_cold[Sub] = entry < cold;
+        }
+
+        for (auto *BB : CurLoop->getBlocks()) {
+            bool is_cold;
+            if (Loop *Sub = getSubLoop(BB))
+                is_cold = sub_cold[Sub];
+            else
+                is_cold = BB != CurLoop->getHeader() && bfi.getBlockFreq(BB).getFrequency() < cold;
+            (is_cold ? ifb : fb).insert(BB);
+        }
+        return true;
+    }
+
+    /// Collect every instruction of the loop that may write the location
+    /// \p load reads. They must all sit on the infrequent path; returns false
+    /// if one of them is on the frequent path. Frequent path stores are
+    /// collected in \p frequent instead when it is given. Writes a runtime
+    /// check has ruled out for this load are skipped.
+    bool getInfrequentClobbers(LoadInst *load, Writes &clobbers, std::vector<StoreInst*> *frequent = nullptr) {
+        for (Instruction *I : loop_writers.get(MemoryLocation::get(load), AA)) {
+            if (guarded.count({load, I})) continue;
+            if (isInfrequent(I->getParent()) && !I->isTerminator())
+                clobbers.insert(I);
+            else if (frequent && isa<StoreInst>(I) && !isInfrequent(I->getParent()))
+                frequent->push_back(cast<StoreInst>(I));
+            else
+                return false;
+        }
+        return !frequent || frequent->empty();
+    }
+
+    /// The same for a call: every loop write whose memory it may read.
+    bool getInfrequentClobbers(CallBase *CB, Writes &clobbers) {
+        if (CB->doesNotAccessMemory() || isPureLibCall(CB)) return true;
+        for (Instruction *I : loop_writers.all()) {
+            bool reads = true;
+            if (auto *Call = dyn_cast<CallBase>(I))
+                reads = isModSet(AA.getModRefInfo(Call, CB));
+            else if (auto Loc = MemoryLocation::getOrNone(I))
+                reads = isRefSet(AA.getModRefInfo(CB, *Loc));
+            if (!reads) continue;
+            if (!isInfrequent(I->getParent()) || I->isTerminator()) return false;
+            clobbers.insert(I);
+        }
+        return true;
+    }
+
+    /// The bytes \p ptr may access as a value of type \p Ty over the whole
+    /// loop, as SCEVs [Low, High). Handles invariant and affine pointers.
+    bool getAccessRange(Value *ptr, Type *Ty, const SCEV *&Low, const SCEV *&High) {
+        const DataLayout &DL = CurLoop->getHeader()->getModule()->getDataLayout();
+        const SCEV *S = SE.getSCEV(ptr);
+        const SCEV *Last = S;
+        if (!SE.isLoopInvariant(S, CurLoop)) {
+            auto *AR = dyn_cast<SCEVAddRecExpr>(S);
+            const SCEV *BTC = SE.getBackedgeTakenCount(CurLoop);
+            if (!AR || AR->getLoop() != CurLoop || !AR->isAffine() || isa<SCEVCouldNotCompute>(BTC))
+                return false;
+            const SCEV *End = AR->evaluateAtIteration(BTC, SE);
+            S = SE.getUMinExpr(AR->getStart(), End);
+            Last = SE.getUMaxExpr(AR->getStart(), End);
+        }
+        Low = S;
+        High = SE.getAddExpr(Last, SE.getConstant(SE.getEffectiveSCEVType(ptr->getType()),
+                                                  DL.getTypeStoreSize(Ty).getFixedSize()));
+        return isSafeToExpand(Low, SE) && isSafeToExpand(High, SE);
+    }
+
+    /// Version an innermost loop when some frequent path loads of invariant
+    /// pointers are only blocked by frequent path stores whose address ranges
+    /// can be computed up front. The preheader checks that none of those
+    /// stores overlaps its load and branches to the current loop, where the
+    /// pairs are recorded in `guarded`, or to a clone of the original loop.
+    bool versionLoop() {
+        if (!CurLoop->isInnermost() || !CurLoop->hasDedicatedExits() || !CurLoop->getLoopPreheader()
+            || findStringMetadataForLoop(CurLoop, VersionedLoopMD))
+            return false;
+
+        struct RangeCheck { LoadInst *load; StoreInst *store; const SCEV *bounds[4]; };
+        std::vector<RangeCheck> checks;
+        for (auto *BB : CurLoop->getBlocks()) {
+            if (!fb.count(BB)) continue;
+            for (auto &I : *BB) {
+                auto *li = dyn_cast<LoadInst>(&I);
+                if (!li || !li->isSimple() || !SE.isLoopInvariant(SE.getSCEV(li->getPointerOperand()), CurLoop))
+                    continue;
+                Writes writes;
+                std::vector<StoreInst*> frequent;
+                if (getInfrequentClobbers(li, writes, &frequent) || frequent.empty()) continue;
+                std::vector<RangeCheck> pairs;
+                for (auto *store : frequent) {
+                    RangeCheck check{li, store, {}};
+                    if (!store->isSimple()
+                        || !getAccessRange(li->getPointerOperand(), li->getType(), check.bounds[0], check.bounds[1])
+                        || !getAccessRange(store->getPointerOperand(), store->getValueOperand()->getType(),
+                                           check.bounds[2], check.bounds[3]))
+                        break;
+                    pairs.push_back(check);
                 }
-            }else{
-                cur = cur->getUniqueSuccessor();
+                if (pairs.size() == frequent.size()) checks.insert(checks.end(), pairs.begin(), pairs.end());
             }
         }
+        if (checks.empty()) return false;
 
-        // If no infrequent path
-        if (ifb.empty()) return false;
-
-        // Get infrequent blocks
-        std::deque<BasicBlock*> bfs;
-        for (auto *BB : ifb) {
-            bfs.push_back(BB);
-            while (!bfs.empty()) {
-                // Check Instructions in current BB
-                for (auto &I : *bfs.front()) {
-                    if (I.getOpcode() == Instruction::Store) {
-                        infrequent_stores.push_back(&I);
-                    }
+        // The two ranges of a pair overlap if each starts before the other
+        // one ends.
+        // Overlaps are taken to be as rare as __builtin_expect makes a branch.
+        ValueToValueMapTy VMap;
+        addFallbackLoop(VMap, /*SlowWeight=*/1, /*FastWeight=*/2000, [&](BasicBlock *CheckBB, IRBuilder<> &B) {
+            const DataLayout &DL = CheckBB->getModule()->getDataLayout();
+            SCEVExpander Exp(SE, DL, "fplicm.check");
+            Value *conflict = nullptr;
+            for (auto &check : checks) {
+                Value *bounds[4];
+                for (int i = 0; i < 4; ++i) {
+                    Value *V = Exp.expandCodeFor(check.bounds[i], check.bounds[i]->getType(), CheckBB->getTerminator());
+                    bounds[i] = B.CreateBitCast(V, B.getInt8PtrTy(V->getType()->getPointerAddressSpace()));
                 }
-                for (auto *succ : successors(bfs.front())) {
-                    if (std::find(bfs.begin(), bfs.end(), succ) == bfs.end()
-                        && fb.find(succ) == fb.end()
-                        && !inSubLoop(succ, L, &LoopInfo)){
-                        bfs.push_back(succ);
-                    }
+                Value *overlap = B.CreateAnd(B.CreateICmpULT(bounds[0], bounds[3]),
+                                             B.CreateICmpULT(bounds[2], bounds[1]), "fplicm.overlap");
+                conflict = conflict ? B.CreateOr(conflict, overlap, "fplicm.conflict") : overlap;
+            }
+            return conflict;
+        });
+
+        for (auto &check : checks) guarded.insert({check.load, check.store});
+        ++NumVersioned;
+        ORE->emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, "Versioned", CurLoop->getStartLoc(), CurLoop->getHeader())
+                   << "versioned loop on " << ore::NV("Checks", (int64_t)checks.size())
+                   << " runtime alias checks";
+        });
+        return true;
+    }
+
+    /// Split a check block off the preheader and add a clone of the loop,
+    /// kept in SlowLoop, that runs when the condition \p makeCheck emits
+    /// there holds. The current loop becomes the fast version. Both leave
+    /// through the original exit blocks. \p VMap maps the loop to the clone.
+    /// The check is weighted \p SlowWeight to \p FastWeight, and the block
+    /// frequencies of the loop are split between the versions accordingly.
+    BasicBlock *addFallbackLoop(ValueToValueMapTy &VMap, uint32_t SlowWeight, uint32_t FastWeight,
+                                function_ref<Value*(BasicBlock*, IRBuilder<>&)> makeCheck) {
+        SmallVector<BasicBlock*, 8> Exits;
+        CurLoop->getUniqueExitBlocks(Exits);
+        formLCSSA(*CurLoop, DT, LI, &SE);
+        BasicBlock *CheckBB = CurLoop->getLoopPreheader();
+        BasicBlock *PH = SplitBlock(CheckBB, CheckBB->getTerminator(), &DT, LI, &MSSAU,
+                                    CurLoop->getHeader()->getName() + ".ph");
+        CheckBB->setName(CurLoop->getHeader()->getName() + ".fplicm.check");
+        IRBuilder<> B(CheckBB->getTerminator());
+        Value *slow = makeCheck(CheckBB, B);
+
+        // Mark the loop before cloning, so both versions carry it.
+        addStringMetadataToLoop(CurLoop, VersionedLoopMD);
+        SmallVector<BasicBlock*, 8> Blocks;
+        SlowLoop = cloneLoopWithPreheader(PH, CheckBB, CurLoop, VMap, ".fplicm.orig", LI, &DT, Blocks);
+        remapInstructionsInBlocks(Blocks, VMap);
+        auto *SlowPH = cast<BasicBlock>(VMap[PH]);
+        Instruction *term = CheckBB->getTerminator();
+        setBranchWeights(BranchInst::Create(SlowPH, PH, slow, term), SlowWeight, FastWeight);
+        term->eraseFromParent();
+        BranchProbability ToSlow = BPI->getEdgeProbability(CheckBB, 0u), ToFast = BPI->getEdgeProbability(CheckBB, 1u);
+        for (auto *BB : CurLoop->getBlocks()) {
+            auto *Clone = cast<BasicBlock>(VMap[BB]);
+            BlockFrequency freq = BFI->getBlockFreq(BB);
+            BFI->setBlockFreq(Clone, (freq * ToSlow).getFrequency());
+            BFI->setBlockFreq(BB, (freq * ToFast).getFrequency());
+            SmallVector<BranchProbability, 4> probs;
+            for (unsigned i = 0, e = BB->getTerminator()->getNumSuccessors(); i != e; ++i)
+                probs.push_back(BPI->getEdgeProbability(BB, i));
+            if (probs.size() > 1) BPI->setEdgeProbability(Clone, probs);
+        }
+        setFrequencyFromEdges(PH, *BFI, *BPI);
+        setFrequencyFromEdges(SlowPH, *BFI, *BPI);
+
+        SmallVector<DominatorTree::UpdateType, 8> updates{{DominatorTree::Insert, CheckBB, SlowPH}};
+        for (auto *Exit : Exits) {
+            for (auto &Phi : Exit->phis()) {
+                for (unsigned i = 0, e = Phi.getNumIncomingValues(); i != e; ++i) {
+                    BasicBlock *From = Phi.getIncomingBlock(i);
+                    if (!CurLoop->contains(From)) continue;
+                    Value *V = Phi.getIncomingValue(i);
+                    Value *Mapped = VMap.lookup(V);
+                    Phi.addIncoming(Mapped ? Mapped : V, cast<BasicBlock>(VMap[From]));
                 }
-                bfs.pop_front();
-            }
-        }
-
-        // Check if we need to do FPLICM
-        std::map<Value*, Correctness::OperandInfo> info;
-//        std::set<Instruction*> insert_pos;
-        for (auto I : infrequent_stores) {
-            auto operand = I->getOperand(1);
-            for (auto li : frequent_loads) {
-                if (li->getOperand(0) == operand) {
-                    bool dep = false;
-                    for (auto si : frequent_stores) {
-                        if (si->getOperand(1) == operand) {
-                            dep = true;
-                            break;
-                        }
-                    }
-                    if (!dep) {
-                        auto ite = info.find(operand);
-//                        insert_pos.insert(I);
-                        if (ite != info.end()) {
-                            ite->second.Insert(dyn_cast<LoadInst>(li), dyn_cast<StoreInst>(I));
-                        }else{
-                            info.insert(ite, std::pair<Value*, Correctness::OperandInfo>(operand, Correctness::OperandInfo(operand, dyn_cast<LoadInst>(li), dyn_cast<StoreInst>(I))));
-                        }
-                    }
+            }
+            for (auto *BB : CurLoop->getBlocks())
+                if (is_contained(successors(BB), Exit))
+                    updates.push_back({DominatorTree::Insert, cast<BasicBlock>(VMap[BB]), Exit});
+            DT.changeImmediateDominator(Exit, CheckBB);
+        }
+        LoopBlocksRPO RPO(CurLoop);
+        RPO.perform(LI);
+        MSSAU.updateForClonedLoop(RPO, Exits, VMap);
+        MSSAU.applyInsertUpdates(updates, DT);
+        return CheckBB;
+    }
+
+    /// Specialize an innermost loop on the profiled values of frequent path
+    /// loads that a frequent path write may change, but in practice does
+    /// not. The preheader checks that each location holds its value and
+    /// runs a copy of the loop in which the loads are that value, or the
+    /// original loop if one does not. No write may come before the load
+    /// within an iteration, so the same check on the backedge covers the
+    /// next one; on a mismatch the copy goes on in the original loop.
+    bool specializeLoop() {
+        if (!CurLoop->isInnermost() || !CurLoop->hasDedicatedExits() || !CurLoop->getLoopPreheader()
+            || !CurLoop->getLoopLatch() || findStringMetadataForLoop(CurLoop, VersionedLoopMD))
+            return false;
+
+        SmallVector<std::pair<LoadInst*, ConstantInt*>, 4> specialized;
+        double stability = 1;
+        SafetyInfo.computeLoopSafetyInfo(CurLoop);
+        Instruction *Entry = CurLoop->getLoopPreheader()->getTerminator();
+        for (auto *BB : CurLoop->getBlocks()) {
+            if (!fb.count(BB)) continue;
+            for (auto &I : *BB) {
+                auto *li = dyn_cast<LoadInst>(&I);
+                MDNode *MD = li ? li->getMetadata(ValueProfileMD) : nullptr;
+                if (!MD || !li->isSimple() || !CurLoop->isLoopInvariant(li->getPointerOperand())) continue;
+                // Loads only written on the infrequent path are hoisted anyway.
+                bool frequent = false, before = false;
+                for (Instruction *W : loop_writers.get(MemoryLocation::get(li), AA)) {
+                    frequent |= !isInfrequent(W->getParent());
+                    before |= reachesInIteration(W, li);
+                }
+                if (!frequent) continue;
+                const char *why = nullptr;
+                if (before)
+                    why = "a write may change it earlier in the iteration";
+                else if (!isSafeToSpeculativelyExecute(li, Entry, &DT) && !SafetyInfo.isGuaranteedToExecute(*li, &DT, CurLoop))
+                    why = "the loop may not load it on every iteration";
+                if (why) {
+                    ORE->emit([&]() {
+                        return OptimizationRemarkMissed(DEBUG_TYPE, "NotSpecialized", li) << "not specialized: " << why;
+                    });
+                    continue;
                 }
+                specialized.push_back({li, mdconst::extract<ConstantInt>(MD->getOperand(0))});
+                uint64_t hits = mdconst::extract<ConstantInt>(MD->getOperand(1))->getZExtValue();
+                uint64_t total = mdconst::extract<ConstantInt>(MD->getOperand(2))->getZExtValue();
+                stability = std::min(stability, total ? (double)hits / total : 0.0);
             }
         }
+        if (specialized.empty()) return false;
+        // Both checks fail about as often as the least stable load changes.
+        auto SlowWeight = (uint32_t)((1 - stability) * 1000000) + 1;
+        auto FastWeight = (uint32_t)(stability * 1000000) + 1;
 
-        // If no instructions need to be hoisted
-        if (info.empty()) return false;
+        // A location that does not hold its value sends the loop to the
+        // original version.
+        auto mismatch = [&](IRBuilder<> &B) {
+            Value *any = nullptr;
+            for (auto &S : specialized) {
+                LoadInst *li = S.first;
+                auto *check = B.CreateAlignedLoad(li->getType(), li->getPointerOperand(), li->getAlign(),
+                                                  li->getName() + ".current");
+                auto *MA = MSSAU.createMemoryAccessInBB(check, nullptr, check->getParent(), MemorySSA::BeforeTerminator);
+                MSSAU.insertUse(cast<MemoryUse>(MA), /*RenameUses=*/true);
+                Value *differs = B.CreateICmpNE(check, S.second, "fplicm.mismatch");
+                any = any ? B.CreateOr(any, differs, "fplicm.mismatch") : differs;
+            }
+            return any;
+        };
+        ValueToValueMapTy VMap;
+        addFallbackLoop(VMap, SlowWeight, FastWeight, [&](BasicBlock *, IRBuilder<> &B) { return mismatch(B); });
 
-        // Analyze FPLICM
-//        errs() << "-----------FPLICM Start!-------------\n";
-        for (auto ite : info) {
-            FPLICM(L->getLoopPreheader(), ite.second);
+        // Check again on the backedge. The original loop takes over with the
+        // values the copy carries into the next iteration.
+        BasicBlock *Header = CurLoop->getHeader();
+        BasicBlock *Recheck = SplitEdge(CurLoop->getLoopLatch(), Header, &DT, LI, &MSSAU);
+        Recheck->setName(Header->getName() + ".fplicm.recheck");
+        IRBuilder<> B(Recheck->getTerminator());
+        Value *differs = mismatch(B);
+        auto *SlowHeader = cast<BasicBlock>(VMap[Header]);
+        BasicBlock *Bail = BasicBlock::Create(Header->getContext(), Header->getName() + ".fplicm.bail",
+                                              Header->getParent(), SlowHeader);
+        BranchInst::Create(SlowHeader, Bail);
+        Instruction *term = Recheck->getTerminator();
+        setBranchWeights(BranchInst::Create(Bail, Header, differs, term), SlowWeight, FastWeight);
+        term->eraseFromParent();
+        if (Loop *Parent = CurLoop->getParentLoop()) Parent->addBasicBlockToLoop(Bail, *LI);
+        for (auto &Phi : Header->phis()) {
+            Value *V = Phi.getIncomingValueForBlock(Recheck);
+            auto *I = dyn_cast<Instruction>(V);
+            if (I && CurLoop->contains(I)) {
+                auto *LCSSA = PHINode::Create(V->getType(), 1, V->getName() + ".lcssa", &Bail->front());
+                LCSSA->addIncoming(V, Recheck);
+                V = LCSSA;
+            }
+            cast<PHINode>(VMap[&Phi])->addIncoming(V, Bail);
         }
-//        errs() << "-----------FPLICM Done!-------------\n";
+        DT.addNewBlock(Bail, Recheck);
+        DT.insertEdge(Bail, SlowHeader);
+        MSSAU.applyInsertUpdates({{DominatorTree::Insert, Recheck, Bail}, {DominatorTree::Insert, Bail, SlowHeader}}, DT);
+        BasicBlock *SlowEntry = InsertPreheaderForLoop(SlowLoop, &DT, LI, &MSSAU, /*PreserveLCSSA=*/true);
+        for (auto *BB : {Recheck, Bail, SlowEntry}) setFrequencyFromEdges(BB, *BFI, *BPI);
 
-        // Doing constant folding here
-//        errs() << "-------Constant Folding Start!-------\n";
-        ConstantFolding(BBs[1], L->getLoopPreheader());
-//        errs() << "-------Constant Folding Done!-------\n";
-        /* *******Implementation Ends Here******* */
+        for (auto &S : specialized) {
+            S.first->replaceAllUsesWith(S.second);
+            MSSAU.removeMemoryAccess(S.first);
+            S.first->eraseFromParent();
+        }
 
+        ++NumSpecialized;
+        ORE->emit([&]() {
+            OptimizationRemark R(DEBUG_TYPE, "Specialized", CurLoop->getStartLoc(), Header);
+            R << "specialized loop on the profiled values of " << ore::NV("Loads", (int64_t)specialized.size())
+              << " loads:";
+            for (auto &S : specialized) R << " " << ore::NV("Value", S.second->getSExtValue());
+            return R;
+        });
         return true;
     }
 
-    static void FPLICM(BasicBlock *PreHeader, Correctness::OperandInfo& info) {
-        Instruction *terminator = PreHeader->getTerminator();
-        std::vector<Instruction *> ins_list;
+    /// Weight the new branch \p BI, as !prof for later passes and block
+    /// placement, and in BPI for the rest of this pass.
+    void setBranchWeights(BranchInst *BI, uint32_t TrueWeight, uint32_t FalseWeight) {
+        BI->setMetadata(LLVMContext::MD_prof, MDBuilder(BI->getContext()).createBranchWeights(TrueWeight, FalseWeight));
+        uint64_t sum = (uint64_t)TrueWeight + FalseWeight;
+        SmallVector<BranchProbability, 2> probs{BranchProbability::getBranchProbability(TrueWeight, sum),
+                                                BranchProbability::getBranchProbability(FalseWeight, sum)};
+        BPI->setEdgeProbability(BI->getParent(), probs);
+    }
 
-//        errs() << "=========FPLICM==========\n";
-//        errs() << "Number of load and store\n";
-//        errs() << "load: " << info.loads.size() << "\n";
-//        errs() << "store: " << info.stores.size() << "\n";
-//        errs() << "Hoisted load instructions\n";
-//        for (auto &I : info.loads) errs() << *I << "\n";
-//        errs() << "=========================\n";
+    /// Whether \p From may run before \p To in the same iteration of the
+    /// innermost loop, that is on a path that does not take the backedge.
+    bool reachesInIteration(Instruction *From, Instruction *To) {
+        BasicBlock *Target = To->getParent();
+        if (From->getParent() == Target) return From->comesBefore(To);
+        SmallVector<BasicBlock*, 8> work{From->getParent()};
+        SmallPtrSet<BasicBlock*, 16> seen{From->getParent()};
+        while (!work.empty()) {
+            for (auto *Succ : successors(work.pop_back_val())) {
+                if (Succ == CurLoop->getHeader() || !CurLoop->contains(Succ)) continue;
+                if (Succ == Target) return true;
+                if (seen.insert(Succ).second) work.push_back(Succ);
+            }
+        }
+        return false;
+    }
 
-        unsigned num = 0;
-        for (auto load : info.loads) {
-            auto *cur = dyn_cast<Instruction>(*load->user_begin());
-            while (true) {
-                if (cur->getNumOperands() == 2) {
-                    if (dyn_cast<Instruction>(cur->getOperand(1)) == nullptr) {
-                        ins_list.push_back(cur);
-                        cur = dyn_cast<Instruction>(*cur->user_begin());
-                        continue;
-                    }
+    /// Instructions that can move to the preheader: no side effects, safe
+    /// to execute on every iteration, and every operand either defined
+    /// outside the loop or hoisted itself. Loads and calls that read memory
+    /// may only be written on the infrequent path. The infrequent writes
+    /// that change \p I, directly or through its operands, are collected in
+    /// \p writes.
+    ///
+    /// Divisions and calls that may trap or not return run unguarded only
+    /// where the loop would run them anyway with the same operands: the
+    /// first iteration reaches them for sure and nothing recomputes them.
+    /// Other divisions are hoisted with a \p guard on their divisor.
+    ///
+    /// Loads, calls and divisions that stay in the loop are reported with
+    /// the reason.
+    bool canHoist(Instruction *I, Writes &writes, bool &guard) {
+        if (isa<PHINode>(I) || I->isTerminator() || isa<AllocaInst>(I) || isa<DbgInfoIntrinsic>(I)
+            || isa<PseudoProbeInst>(I))
+            return false;
+        const char *why = getHoistBlocker(I, writes, guard);
+        if (!why) {
+            WriteOrder order = getWriteOrder(I, writes);
+            if (order == WriteOrder::Mixed)
+                why = "an infrequent write may run before some of the memory it reads and after the rest";
+            else if (order == WriteOrder::After)
+                next_iteration.insert(I);
+        }
+        if (why && (isa<LoadInst>(I) || isa<CallBase>(I) || I->isIntDivRem()))
+            ORE->emit([&]() {
+                return OptimizationRemarkMissed(DEBUG_TYPE, "NotHoisted", I) << "not hoisted: " << why;
+            });
+        return !why;
+    }
 
-                    break;
+    enum class WriteOrder { Before, After, Mixed };
+
+    /// When the loop \p writes that change \p I run within an iteration,
+    /// relative to the memory reads \p I is computed from: Before if each
+    /// one may run before the reads it changes, and never after them, so the
+    /// value at the original block already includes it. After if none can
+    /// run before them: \p I then keeps its value until the next iteration.
+    /// Reads through a hoisted operand count for every write of that operand.
+    WriteOrder getWriteOrder(Instruction *I, const Writes &writes) {
+        SmallVector<Instruction*, 8> readers, work{I};
+        SmallPtrSet<Instruction*, 8> seen{I};
+        while (!work.empty()) {
+            Instruction *cur = work.pop_back_val();
+            if (cur->mayReadFromMemory()) readers.push_back(cur);
+            for (Value *Op : cur->operands())
+                if (auto *OpI = dyn_cast<Instruction>(Op))
+                    if (clobbers.count(OpI) && seen.insert(OpI).second) work.push_back(OpI);
+        }
+        bool before = false, after = false;
+        for (Instruction *W : writes) {
+            if (!CurLoop->contains(W)) continue;
+            for (Instruction *R : readers) {
+                if (R != I && !clobbers[R].count(W)) continue;
+                if (!reachesInIteration(W, R)) after = true;
+                else if (reachesInIteration(R, W)) return WriteOrder::Mixed;
+                else before = true;
+            }
+        }
+        if (before && after) return WriteOrder::Mixed;
+        return after ? WriteOrder::After : WriteOrder::Before;
+    }
+
+    /// What keeps \p I in the loop, or null if it can be hoisted.
+    const char *getHoistBlocker(Instruction *I, Writes &writes, bool &guard) {
+        auto *CB = dyn_cast<CallBase>(I);
+        if (!isPureLibCall(I)
+            && (I->mayHaveSideEffects() || (CB && (CB->isConvergent() || CB->hasOperandBundles()))))
+            return "it may write memory, throw or not return";
+        for (Value *Op : CB ? CB->args() : I->operands()) {
+            auto it = clobbers.find(dyn_cast<Instruction>(Op));
+            if (it != clobbers.end())
+                writes.insert(it->second.begin(), it->second.end());
+            else if (!CurLoop->isLoopInvariant(Op))
+                return "an operand changes in the loop";
+        }
+        if (CB && !CurLoop->isLoopInvariant(CB->getCalledOperand())) return "the callee changes in the loop";
+
+        if (auto *li = dyn_cast<LoadInst>(I)) {
+            if (!li->isSimple()) return "volatile or atomic";
+            return getInfrequentClobbers(li, writes) ? nullptr : "the frequent path may write its memory";
+        }
+        if (CB && !getInfrequentClobbers(CB, writes)) return "the frequent path may write memory it reads";
+        if (isSafeToSpeculativelyExecute(I) || isPureLibCall(I)) return nullptr;
 
-                } else {
-                    ins_list.push_back(cur);
-                    cur = dyn_cast<Instruction>(*cur->user_begin());
+        if (writes.empty() && SafetyInfo.isGuaranteedToExecute(*I, &DT, CurLoop)) {
+            unguarded.insert(I);
+            return nullptr;
+        }
+        guard = I->isIntDivRem() && I->getType()->isIntegerTy();
+        return guard ? nullptr : "it may trap and the loop may not run it";
+    }
+
+    /// Calls the target library info knows to compute a pure function of
+    /// their arguments, defined for all of them. Without attributes,
+    /// e.g. at -O0, they otherwise look like writes to unknown memory.
+    /// Math functions that may set errno only count when the call is
+    /// marked as not touching memory, as with -fno-math-errno.
+    bool isPureLibCall(Instruction *I) {
+        auto *CB = dyn_cast<CallBase>(I);
+        LibFunc F;
+        if (!CB || !CB->getCalledFunction() || !TLI.getLibFunc(*CB->getCalledFunction(), F) || !TLI.has(F))
+            return false;
+        switch (F) {
+        case LibFunc_abs: case LibFunc_labs: case LibFunc_llabs:
+        case LibFunc_fabs: case LibFunc_fabsf: case LibFunc_fabsl:
+        case LibFunc_floor: case LibFunc_floorf: case LibFunc_floorl:
+        case LibFunc_ceil: case LibFunc_ceilf: case LibFunc_ceill:
+        case LibFunc_trunc: case LibFunc_truncf: case LibFunc_truncl:
+        case LibFunc_round: case LibFunc_roundf: case LibFunc_roundl:
+        case LibFunc_rint: case LibFunc_rintf: case LibFunc_rintl:
+        case LibFunc_nearbyint: case LibFunc_nearbyintf: case LibFunc_nearbyintl:
+        case LibFunc_copysign: case LibFunc_copysignf: case LibFunc_copysignl:
+        case LibFunc_fmin: case LibFunc_fminf: case LibFunc_fminl:
+        case LibFunc_fmax: case LibFunc_fmaxf: case LibFunc_fmaxl:
+            return true;
+        case LibFunc_sqrt: case LibFunc_sqrtf: case LibFunc_sqrtl:
+        case LibFunc_sin: case LibFunc_sinf: case LibFunc_sinl:
+        case LibFunc_cos: case LibFunc_cosf: case LibFunc_cosl:
+        case LibFunc_tan: case LibFunc_tanf: case LibFunc_tanl:
+        case LibFunc_exp: case LibFunc_expf: case LibFunc_expl:
+        case LibFunc_exp2: case LibFunc_exp2f: case LibFunc_exp2l:
+        case LibFunc_log: case LibFunc_logf: case LibFunc_logl:
+        case LibFunc_log2: case LibFunc_log2f: case LibFunc_log2l:
+        case LibFunc_log10: case LibFunc_log10f: case LibFunc_log10l:
+        case LibFunc_pow: case LibFunc_powf: case LibFunc_powl:
+        case LibFunc_fmod: case LibFunc_fmodf: case LibFunc_fmodl:
+            return CB->doesNotAccessMemory();
+        default:
+            return false;
+        }
+    }
+
+    /// Make the integer division \p I safe to run where the loop would not:
+    /// a divisor that traps, zero or -1 with the smallest dividend, becomes
+    /// 1. The result only differs where the original was undefined. The
+    /// guard goes right before \p I, so it is hoisted and recomputed with
+    /// it, and is appended to \p guards in order. Constant operands rule
+    /// out the checks they cannot fail.
+    void guardDivision(BinaryOperator *I, SmallVectorImpl<Instruction*> &guards) {
+        IRBuilder<> Builder(I);
+        Instruction *Prev = I->getPrevNode();
+        Type *Ty = I->getType();
+        // The check and the division must see the same value.
+        auto freeze = [&](Value *V, const char *Name) {
+            return isGuaranteedNotToBeUndefOrPoison(V) ? V : Builder.CreateFreeze(V, Name);
+        };
+        Value *divisor = freeze(I->getOperand(1), "guard.d");
+        Value *traps = Builder.CreateICmpEQ(divisor, ConstantInt::get(Ty, 0), "guard.z");
+        auto *D = dyn_cast<ConstantInt>(divisor);
+        auto *Min = ConstantInt::get(Ty, APInt::getSignedMinValue(Ty->getIntegerBitWidth()));
+        auto *X = dyn_cast<ConstantInt>(I->getOperand(0));
+        if ((I->getOpcode() == Instruction::SDiv || I->getOpcode() == Instruction::SRem)
+            && (!D || D->isMinusOne()) && (!X || X == Min)) {
+            Value *dividend = freeze(I->getOperand(0), "guard.x");
+            Value *overflows = Builder.CreateAnd(Builder.CreateICmpEQ(divisor, Constant::getAllOnesValue(Ty), "guard.m1"),
+                                                 Builder.CreateICmpEQ(dividend, Min, "guard.min"), "guard.o");
+            traps = Builder.CreateOr(traps, overflows, "guard.t");
+            I->setOperand(0, dividend);
+        }
+        I->setOperand(1, Builder.CreateSelect(traps, ConstantInt::get(Ty, 1), divisor, "guard.safe"));
+        for (Instruction *G = Prev ? Prev->getNextNode() : &I->getParent()->front(); G != I; G = G->getNextNode())
+            guards.push_back(G);
+    }
+
+    /// Execution count of \p BB: the profile count when the function has
+    /// one, the relative block frequency otherwise. Either way all blocks of
+    /// a function are measured in the same unit.
+    int64_t blockCount(BasicBlock *BB) {
+        if (auto count = BFI->getBlockProfileCount(BB))
+            return *count;
+        return BFI->getBlockFreq(BB).getFrequency();
+    }
+
+    /// Weigh what hoisting \p I saves on the frequent path against what it
+    /// costs: it runs once in the preheader and is recomputed after every
+    /// infrequent write in \p writes. The estimate is kept for the remark
+    /// once the selection is final; unprofitable ones are reported here.
+    bool isProfitable(Instruction *I, Writes &writes, BasicBlock *PreHeader) {
+        int64_t saved = blockCount(I->getParent());
+        int64_t cost = blockCount(PreHeader);
+        for (auto write : writes) cost += blockCount(write->getParent());
+        int64_t benefit = saved - cost;
+        estimates[I] = {saved, cost};
+
+        if (benefit > 0) return true;
+        ORE->emit([&]() {
+            return OptimizationRemarkMissed(DEBUG_TYPE, "NotProfitable", I)
+                   << "not hoisted, estimated benefit " << ore::NV("Benefit", benefit)
+                   << " (saved " << ore::NV("Saved", saved) << ", fix-up cost " << ore::NV("Cost", cost) << ")";
+        });
+        return false;
+    }
+
+    /// The register class \p V takes, if it goes in a register.
+    Optional<unsigned> getRegisterClass(Value *V) {
+        Type *Ty = V->getType();
+        if (!Ty->isIntOrIntVectorTy() && !Ty->isFPOrFPVectorTy() && !Ty->isPtrOrPtrVectorTy()) return None;
+        return TTI.getRegisterClassForType(Ty->isVectorTy(), Ty);
+    }
+
+    /// Keep hoisting within the registers of the target. A hoisted value
+    /// that the loop still uses stays in a register across the whole loop,
+    /// on top of what the loop needs already: the values live across it,
+    /// invariants and header phis, and the most loop values live at once,
+    /// from their live ranges in reverse post order. Candidates are taken by
+    /// their estimated benefit, each with the hoisted operands it needs,
+    /// and those that would need more registers of a class than there are
+    /// stay in the loop, with their hoisted users.
+    void limitRegisterPressure() {
+        if (hoisted.empty()) return;
+        SmallDenseMap<unsigned, unsigned, 4> base;
+        SmallPtrSet<Value*, 32> live_in;
+        LoopBlocksRPO RPO(CurLoop);
+        RPO.perform(LI);
+        DenseMap<Instruction*, unsigned> order;
+        for (auto *BB : RPO)
+            for (auto &I : *BB) {
+                unsigned N = order.size();
+                order[&I] = N;
+            }
+        SmallDenseMap<unsigned, std::vector<int>, 4> ranges;
+        unsigned end = order.size();
+        for (auto *BB : RPO) {
+            for (auto &I : *BB) {
+                for (Value *Op : I.operands()) {
+                    auto *OpI = dyn_cast<Instruction>(Op);
+                    if ((isa<Argument>(Op) || (OpI && !CurLoop->contains(OpI) && !isa<AllocaInst>(OpI)))
+                        && live_in.insert(Op).second)
+                        if (auto RC = getRegisterClass(Op)) ++base[*RC];
+                }
+                auto RC = getRegisterClass(&I);
+                if (!RC || I.use_empty()) continue;
+                if (isa<PHINode>(I) && BB == CurLoop->getHeader()) {
+                    ++base[*RC];
+                    continue;
                 }
+                unsigned last = order[&I];
+                for (User *U : I.users()) {
+                    auto *UI = cast<Instruction>(U);
+                    bool carried = !CurLoop->contains(UI) || (isa<PHINode>(UI) && UI->getParent() == CurLoop->getHeader());
+                    last = std::max(last, carried ? end : order[UI]);
+                }
+                auto &range = ranges[*RC];
+                range.resize(end + 1);
+                ++range[order[&I]];
+                --range[last];
             }
+        }
+        for (auto &R : ranges) {
+            int live = 0, peak = 0;
+            for (int change : R.second) peak = std::max(peak, live += change);
+            base[R.first] += peak;
+        }
 
-            auto prev = *ins_list.rbegin();
-            load->moveBefore(terminator);
-            for(auto ite = ins_list.begin()+num; ite != ins_list.end(); ite++){
-                (*ite)->moveBefore(terminator);
+        // Hoisted values that stay in a register: used in the loop by a value
+        // that is not hoisted.
+        SmallPtrSet<Instruction*, 32> taken;
+        SmallDenseMap<unsigned, int, 4> kept;
+        auto registers = [&](unsigned RC) { return int(RegisterLimit ? RegisterLimit : TTI.getNumberOfRegisters(RC)); };
+        auto staysLive = [&](Instruction *I) {
+            return any_of(I->users(), [&](User *U) {
+                auto *UI = cast<Instruction>(U);
+                return CurLoop->contains(UI) && !taken.count(UI);
+            });
+        };
+        // A candidate and the hoisted operands it needs that are not taken.
+        auto closure = [&](Instruction *I) {
+            SmallSetVector<Instruction*, 8> needed;
+            needed.insert(I);
+            for (unsigned i = 0; i < needed.size(); ++i)
+                for (Value *Op : needed[i]->operands())
+                    if (auto *OpI = dyn_cast<Instruction>(Op))
+                        if (CurLoop->contains(OpI) && !taken.count(OpI)) needed.insert(OpI);
+            return needed;
+        };
+        // Ranked by what hoisting them with their operands saves, so that
+        // the value a chain ends in comes before its parts.
+        DenseMap<Instruction*, int64_t> gains;
+        for (auto *I : hoisted)
+            for (auto *N : closure(I)) gains[I] += std::max<int64_t>(estimates[N].saved - estimates[N].cost, 0);
+        std::vector<Instruction*> ranked(hoisted);
+        std::stable_sort(ranked.begin(), ranked.end(),
+                         [&](Instruction *A, Instruction *B) { return gains[A] > gains[B]; });
+        for (auto *I : ranked) {
+            if (taken.count(I)) continue;
+            auto needed = closure(I);
+            SmallPtrSet<Instruction*, 8> affected(needed.begin(), needed.end());
+            for (auto *N : needed)
+                for (Value *Op : N->operands())
+                    if (auto *OpI = dyn_cast<Instruction>(Op))
+                        if (taken.count(OpI)) affected.insert(OpI);
+
+            // Registers each class gains, or frees when operands hoisted
+            // before have no users left in the loop.
+            SmallDenseMap<unsigned, int, 4> delta;
+            auto count = [&](int sign) {
+                for (auto *A : affected)
+                    if (taken.count(A) && staysLive(A))
+                        if (auto RC = getRegisterClass(A)) delta[*RC] += sign;
+            };
+            count(-1);
+            taken.insert(needed.begin(), needed.end());
+            count(1);
+            bool fits = true;
+            for (auto &D : delta) {
+                if (D.second > 0 && int(base[D.first]) + kept[D.first] + D.second > registers(D.first)) fits = false;
+            }
+            if (fits) {
+                for (auto &D : delta) kept[D.first] += D.second;
+                continue;
             }
+            for (auto *N : needed) taken.erase(N);
+            ++NumPressureLimited;
+            ORE->emit([&]() {
+                return OptimizationRemarkMissed(DEBUG_TYPE, "RegisterPressure", I)
+                       << "not hoisted: it would stay live across the loop, which already needs all "
+                       << "registers of its class";
+            });
+        }
 
-            // Allocate new var on stack ot store post-calculated value.
-            auto *var = new AllocaInst(prev->getType(), 0, nullptr, Align(16), "var", terminator);
-            // Insert new store to ins_list
-            ins_list.push_back(new StoreInst(prev, var, terminator));
-            // Insert new load to directly load post-calculated value.
-            auto *new_load = new LoadInst(prev->getType(), var, "fix", cur);
-            // Chang specific operand of cur instruction to the post-calculated value
-            if (cur->getOpcode() == Instruction::Store) {
-                std::vector<Value*> temp_save;
-                for (auto *usr : cur->getOperand(1)->users()) {
-                    if (dyn_cast<Instruction>(usr)->getOpcode() == Instruction::Load 
-                        && dyn_cast<Instruction>(usr)->getParent() == dyn_cast<Instruction>(cur)->getParent()){
-                            usr->replaceAllUsesWith(new_load);
-                            temp_save.push_back(usr);
-                    }
+        ORE->emit([&]() {
+            OptimizationRemarkAnalysis R(DEBUG_TYPE, "RegisterPressure", CurLoop->getStartLoc(), CurLoop->getHeader());
+            R << "estimated register pressure:";
+            for (auto &B : base) {
+                R << " " << ore::NV("Class", TTI.getRegisterClassName(B.first)) << " "
+                  << ore::NV("Live", int(B.second) + kept[B.first]) << "/" << ore::NV("Registers", registers(B.first));
+            }
+            return R;
+        });
+        if (taken.size() == hoisted.size()) return;
+        hoisted.erase(std::remove_if(hoisted.begin(), hoisted.end(), [&](Instruction *I) { return !taken.count(I); }),
+                      hoisted.end());
+    }
+
+    /// Raise hoisted values out of the enclosing loops, to the preheader of
+    /// the outermost one whose frequent path leaves them invariant as well,
+    /// so they no longer run once per iteration of those loops. The writes of
+    /// this loop already get fix-ups, which carry over; at every level the
+    /// writes of the enclosing loop outside the inner one need fix-ups of
+    /// their own, and have to pay off like the ones of this loop.
+    void hoistOutOfNest() {
+        for (auto *I : hoisted) {
+            Loop *Inner = CurLoop;
+            for (Loop *Outer = Inner->getParentLoop(); Outer && Outer->getLoopPreheader();
+                 Outer = Outer->getParentLoop()) {
+                Writes writes;
+                if (!canHoistOutOf(I, Outer, Inner, writes)) break;
+                int64_t saved = blockCount(Inner->getLoopPreheader());
+                int64_t cost = blockCount(Outer->getLoopPreheader());
+                for (auto write : writes)
+                    if (!clobbers[I].count(write)) cost += blockCount(write->getParent());
+                if (cost >= saved) break;
+                clobbers[I].insert(writes.begin(), writes.end());
+                levels[I] = Outer;
+                Inner = Outer;
+            }
+            if (Inner == CurLoop) continue;
+            ++NumRaised;
+            ORE->emit([&]() {
+                return OptimizationRemark(DEBUG_TYPE, "HoistedOutOfNest", I)
+                       << "hoisted out of " << ore::NV("Loops", CurLoop->getLoopDepth() - Inner->getLoopDepth() + 1)
+                       << " nested loops";
+            });
+        }
+    }
+
+    /// Whether \p I, hoisted out of \p Inner, also stays invariant on the
+    /// frequent path of the enclosing \p Outer: its operands come from
+    /// outside \p Outer or are raised themselves, and the writes of
+    /// \p Outer outside \p Inner that change it sit in infrequent blocks of
+    /// \p Outer itself. Those writes, direct or through operands, are
+    /// collected in \p writes.
+    bool canHoistOutOf(Instruction *I, Loop *Outer, Loop *Inner, Writes &writes) {
+        // Only the inner loop is known to run these, and only its writes are
+        // checked for calls.
+        if (unguarded.count(I) || (isa<CallBase>(I) && !isPureLibCall(I) && I->mayReadFromMemory())) return false;
+        for (Value *Op : I->operands()) {
+            auto it = levels.find(dyn_cast<Instruction>(Op));
+            if (it != levels.end()) {
+                if (!it->second->contains(Outer)) return false;
+                writes.insert(clobbers[it->first].begin(), clobbers[it->first].end());
+            } else if (!Outer->isLoopInvariant(Op)) {
+                return false;
+            }
+        }
+        if (auto *li = dyn_cast<LoadInst>(I)) {
+            double cold = (1 - getThreshold(Outer, *LI)) * BFI->getBlockFreq(Outer->getHeader()).getFrequency();
+            for (Instruction *W : getOuterWriters(Outer, Inner).get(MemoryLocation::get(li), AA)) {
+                BasicBlock *BB = W->getParent();
+                if (W->isTerminator() || LI->getLoopFor(BB) != Outer || BFI->getBlockFreq(BB).getFrequency() >= cold)
+                    return false;
+                writes.insert(W);
+            }
+        }
+        return true;
+    }
+
+    /// The MemoryDefs of \p Outer outside its subloop \p Inner.
+    WriterIndex &getOuterWriters(Loop *Outer, Loop *Inner) {
+        auto it = outer_writers.find(Outer);
+        if (it != outer_writers.end()) return it->second;
+        WriterIndex &index = outer_writers[Outer];
+        for (auto *BB : Outer->getBlocks()) {
+            if (Inner->contains(BB)) continue;
+            if (auto *Defs = MSSA.getBlockDefs(BB))
+                for (auto &MA : *Defs)
+                    if (auto *Def = dyn_cast<MemoryDef>(&MA)) index.add(Def->getMemoryInst());
+        }
+        index.finish();
+        return index;
+    }
+
+    /// The connected parts of the infrequent path of this loop, in loop
+    /// block order.
+    std::vector<SmallSetVector<BasicBlock*, 8>> getColdRegions() {
+        std::vector<SmallSetVector<BasicBlock*, 8>> regions;
+        SmallPtrSet<BasicBlock*, 32> seen;
+        for (auto *BB : CurLoop->getBlocks()) {
+            if (!isInfrequent(BB) || !seen.insert(BB).second) continue;
+            auto &region = regions.emplace_back();
+            region.insert(BB);
+            for (unsigned i = 0; i < region.size(); ++i) {
+                BasicBlock *cur = region[i];
+                auto visit = [&](BasicBlock *next) {
+                    if (isInfrequent(next) && CurLoop->contains(next) && seen.insert(next).second) region.insert(next);
+                };
+                for (auto *Succ : successors(cur)) visit(Succ);
+                for (auto *Pred : predecessors(cur)) visit(Pred);
+            }
+        }
+        return regions;
+    }
+
+    /// The hoisted values to recompute after \p writes: the ones they
+    /// change, and the hoisted operands those need. Walking the list
+    /// backwards reaches every user before its operands.
+    SmallPtrSet<Instruction*, 16> getNeeded(ArrayRef<Instruction*> writes) {
+        SmallPtrSet<Instruction*, 16> needed;
+        for (auto it = hoisted.rbegin(); it != hoisted.rend(); ++it) {
+            Instruction *I = *it;
+            auto &changed_by = clobbers[I];
+            if (!needed.count(I) && llvm::none_of(writes, [&](Instruction *W) { return changed_by.count(W); }))
+                continue;
+            needed.insert(I);
+            for (Value *Op : I->operands())
+                if (auto *OpI = dyn_cast<Instruction>(Op))
+                    if (clobbers.count(OpI)) needed.insert(OpI);
+        }
+        return needed;
+    }
+
+    /// Clone the \p needed hoisted values, in order, before \p pos. Memory
+    /// accesses go after \p lastMA, or at the end of the block without one.
+    void recompute(const SmallPtrSetImpl<Instruction*> &needed, Instruction *pos, MemoryAccess *lastMA,
+                   DenseMap<Instruction*, SmallVector<Instruction*, 4>> &copies) {
+        ValueToValueMapTy VMap;
+        for (auto I : hoisted) {
+            if (!needed.count(I)) continue;
+            Instruction *curr = I->clone();
+            RemapInstruction(curr, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+            curr->insertBefore(pos);
+            if (MSSA.getMemoryAccess(I)) {
+                lastMA = lastMA ? MSSAU.createMemoryAccessAfter(curr, nullptr, lastMA)
+                                : MSSAU.createMemoryAccessInBB(curr, nullptr, pos->getParent(), MemorySSA::BeforeTerminator);
+                // Library calls without attributes look like writes.
+                if (auto *Def = dyn_cast<MemoryDef>(lastMA))
+                    MSSAU.insertDef(Def, /*RenameUses=*/true);
+                else
+                    MSSAU.insertUse(cast<MemoryUse>(lastMA), /*RenameUses=*/true);
+            }
+            VMap[I] = curr;
+            copies[I].push_back(curr);
+            ++added;
+        }
+    }
+
+    /// Recompute what the \p writes of the cold \p region change in one
+    /// fix-up block per block the region leads back to. Only done when that
+    /// takes fewer blocks than there are writes, and all those edges can be
+    /// split. Values raised out of this loop are not recomputed on the way
+    /// out of it, so a region that leaves the loop keeps copies after each
+    /// write for them.
+    bool placeFixUps(const SmallSetVector<BasicBlock*, 8> &region, ArrayRef<Instruction*> writes,
+                     DenseMap<Instruction*, SmallVector<Instruction*, 4>> &copies) {
+        if (writes.size() < 2) return false;
+        auto needed = getNeeded(writes);
+        bool raised = llvm::any_of(needed, [&](Instruction *I) { return levels[I] != CurLoop; });
+        MapVector<BasicBlock*, SmallVector<BasicBlock*, 4>> targets;
+        for (auto *BB : region) {
+            Instruction *term = BB->getTerminator();
+            for (auto *Succ : successors(BB)) {
+                if (region.count(Succ)) continue;
+                if (!CurLoop->contains(Succ)) {
+                    if (raised) return false;
+                    continue;
                 }
-                for (auto *i : temp_save) dyn_cast<Instruction>(i)->eraseFromParent();
-                cur->eraseFromParent();
-                dyn_cast<Instruction>(cur->getOperand(1))->eraseFromParent();
-            }else{
-                cur->setOperand(cur->getOperand(0) == prev ? 0 : 1, new_load);
+                if (Succ->isEHPad() || isa<IndirectBrInst>(term) || isa<CallBrInst>(term)) return false;
+                auto &preds = targets[Succ];
+                if (!is_contained(preds, BB)) preds.push_back(BB);
             }
+        }
+        if (targets.size() >= writes.size()) return false;
+
+        for (auto &target : targets) {
+            BasicBlock *FixUp = SplitBlockPredecessors(target.first, target.second, ".fplicm.fixup", &DT, LI, &MSSAU,
+                                                       /*PreserveLCSSA=*/true);
+            setFrequencyFromEdges(FixUp, *BFI, *BPI);
+            ifb.insert(FixUp);
+            recompute(needed, FixUp->getTerminator(), nullptr, copies);
+            ++added;
+            ++fixup_blocks;
+        }
+        return true;
+    }
 
-            num = ins_list.size();
+    /// Move the collected instructions to the preheader, recompute them after
+    /// the infrequent writes that change them, and join the hoisted values
+    /// and the fix-ups with phis, so the frequent path reads them straight
+    /// from registers.
+    void FPLICM() {
+        DenseMap<Instruction*, BasicBlock*> origin;
+        Writes writes;
+        Loop *outermost = CurLoop;
+        for (auto I : hoisted) {
+            origin[I] = I->getParent();
+            BasicBlock *Dest = levels[I]->getLoopPreheader();
+            I->moveBefore(Dest->getTerminator());
+            if (auto *MA = MSSA.getMemoryAccess(I))
+                MSSAU.moveToPlace(MA, Dest, MemorySSA::BeforeTerminator);
+            writes.insert(clobbers[I].begin(), clobbers[I].end());
+            if (levels[I]->contains(outermost)) outermost = levels[I];
         }
 
-        Value *curr, *prev, *origin;
-        for (auto store : info.stores) {
-            origin = store->getOperand(0);
-            prev = origin;
-            for (auto I : ins_list) {
-                curr = I->clone();
-                auto Icurr = dyn_cast<Instruction>(curr);
-                if (I->getOpcode() == Instruction::Store){
-                    Icurr->setOperand(0, prev);
-                    prev = origin;
-                }else{
-                    unsigned idx = 0;
-                    // Assume instructions are continues. Maybe not correct!!!
-                    for (auto p = I->op_begin(); p != I->op_end() ; p++ ) {
-                        if (*p == I->getPrevNode()){
-                            Icurr->setOperand(idx, prev);
-                        }
-                        idx++;
+        // A cold region, a connected part of this loop's infrequent path,
+        // with several writes recomputes what they change once, in fix-up
+        // blocks on the edges back into the rest of the loop. Uses read the
+        // value of the frequent block the original instruction was in, and
+        // the region only gets there through a fix-up block. Other writes,
+        // and those of enclosing loops, are followed by their own copies.
+        DenseMap<Instruction*, SmallVector<Instruction*, 4>> copies;
+        SmallPtrSet<Instruction*, 16> shared;
+        for (auto &region : getColdRegions()) {
+            SmallVector<Instruction*, 4> region_writes;
+            for (auto write : writes)
+                if (region.count(write->getParent())) region_writes.push_back(write);
+            if (placeFixUps(region, region_writes, copies)) shared.insert(region_writes.begin(), region_writes.end());
+        }
+        for (auto write : writes)
+            if (!shared.count(write))
+                recompute(getNeeded(write), write->getNextNode(), MSSA.getMemoryAccess(write), copies);
+
+        // Values read before the writes in an iteration only see the fix-ups
+        // from the next one on, through the header.
+        for (auto I : hoisted) {
+            rewriteUses(I, next_iteration.count(I) ? CurLoop->getHeader() : origin[I], copies[I]);
+        }
+
+        // Operands recomputed for a value that is dead where the copies are
+        // go again. Users of a copy come later in the list.
+        for (auto it = hoisted.rbegin(); it != hoisted.rend(); ++it)
+            for (Instruction *copy : copies[*it])
+                if (copy->use_empty()) {
+                    MSSAU.removeMemoryAccess(copy);
+                    copy->eraseFromParent();
+                    --added;
+                }
+        ORE->emit([&]() {
+            return OptimizationRemarkAnalysis(DEBUG_TYPE, "CodeSize", CurLoop->getStartLoc(), CurLoop->getHeader())
+                   << "fix-ups added " << ore::NV("Instructions", added) << " instructions, "
+                   << "with " << ore::NV("FixUpBlocks", fixup_blocks) << " shared fix-up blocks";
+        });
+        ORE->emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, "HoistedChains", CurLoop->getStartLoc(), CurLoop->getHeader())
+                   << "hoisted " << ore::NV("Instructions", (int64_t)hoisted.size()) << " instructions, "
+                   << ore::NV("Loads", (int64_t)llvm::count_if(hoisted, [](Instruction *I) { return isa<LoadInst>(I); }))
+                   << " of them loads, recomputed after " << ore::NV("Writes", (int64_t)writes.size())
+                   << " infrequent writes";
+        });
+        NumHoisted += hoisted.size();
+        NumLoadsHoisted += llvm::count_if(hoisted, [](Instruction *I) { return isa<LoadInst>(I); });
+        NumFixUps += added;
+        NumFixUpBlocks += fixup_blocks;
+
+        // The fix-ups inside this loop now feed the enclosing loops as well.
+        if (outermost != CurLoop) {
+            formLCSSARecursively(*outermost, DT, LI, &SE);
+            SE.forgetLoop(outermost);
+        }
+    }
+
+    /// Point every remaining use of the hoisted \p I at its value at the
+    /// entry of \p BB, its original block or the loop header: the preheader
+    /// copy, or the latest of its \p copies on the way there. Values hoisted
+    /// into the preheader of an inner loop read it there instead.
+    void rewriteUses(Instruction *I, BasicBlock *BB, ArrayRef<Instruction*> copies) {
+        // Nothing recomputes it, so the preheader value holds everywhere.
+        if (copies.empty()) return;
+        BasicBlock *PreHeader = I->getParent();
+        SmallVector<std::pair<Use*, BasicBlock*>, 8> uses;
+        for (Use &U : I->uses()) {
+            auto *User = cast<Instruction>(U.getUser());
+            if (User->getParent() != PreHeader)
+                uses.push_back({&U, levels.count(User) ? User->getParent() : BB});
+        }
+        if (uses.empty()) return;
+
+        // The last copy of a block is the value that leaves it.
+        SmallDenseMap<BasicBlock*, Value*, 8> out;
+        out[PreHeader] = I;
+        for (auto copy : copies) {
+            auto &slot = out[copy->getParent()];
+            if (!slot || cast<Instruction>(slot)->comesBefore(copy)) slot = copy;
+        }
+        SmallPtrSet<BasicBlock*, 8> defs;
+        for (auto &it : out) defs.insert(it.first);
+
+        // Phis are needed where the copies meet the preheader value, as far
+        // as the value flows into the original block; that is the iterated
+        // dominance frontier of the copies, pruned to the blocks it is live
+        // in. SSAUpdater would find the same phis, but it compares every new
+        // one against all phis already in the block, and the loop header
+        // collects one per hoisted value.
+        SmallPtrSet<BasicBlock*, 32> live;
+        SmallVector<BasicBlock*, 32> worklist;
+        for (auto &use : uses) worklist.push_back(use.second);
+        while (!worklist.empty()) {
+            BasicBlock *cur = worklist.pop_back_val();
+            if (!live.insert(cur).second) continue;
+            for (auto *pred : predecessors(cur))
+                if (!defs.count(pred)) worklist.push_back(pred);
+        }
+        SmallVector<BasicBlock*, 8> phi_blocks;
+        ForwardIDFCalculator IDF(DT);
+        IDF.setDefiningBlocks(defs);
+        IDF.setLiveInBlocks(live);
+        IDF.calculate(phi_blocks);
+
+        // The value at the entry of a block is its phi, or what leaves its
+        // immediate dominator.
+        SmallDenseMap<BasicBlock*, Value*, 8> in;
+        for (auto *phi_block : phi_blocks)
+            in[phi_block] = PHINode::Create(I->getType(), pred_size(phi_block), "fix", &phi_block->front());
+        added += phi_blocks.size();
+        auto valueIn = [&](BasicBlock *cur) {
+            while (true) {
+                if (Value *V = in.lookup(cur)) return V;
+                cur = DT.getNode(cur)->getIDom()->getBlock();
+                if (Value *V = out.lookup(cur)) return V;
+            }
+        };
+        for (auto *phi_block : phi_blocks) {
+            auto *phi = cast<PHINode>(in[phi_block]);
+            for (auto *pred : predecessors(phi_block)) {
+                Value *V = out.lookup(pred);
+                phi->addIncoming(V ? V : valueIn(pred), pred);
+            }
+        }
+
+        // The block is on the frequent path, so it holds no copy and the
+        // value at its entry is the one the old instruction computed.
+        for (auto &use : uses) use.first->set(valueIn(use.second));
+    }
+
+    /// Sink frequent path instructions whose users all sit in infrequent
+    /// blocks of this loop or in its exit blocks: each of those blocks gets
+    /// its own copy, and the frequent path no longer computes the value.
+    /// Users are visited before their operands, so whole chains move.
+    bool sinkColdComputations() {
+        LoopBlocksRPO RPO(CurLoop);
+        RPO.perform(LI);
+        SmallVector<BasicBlock*, 32> blocks(RPO.begin(), RPO.end());
+        bool changed = false;
+        bool left_loop = false;
+        for (auto *BB : llvm::reverse(blocks)) {
+            if (!fb.count(BB) || LI->getLoopFor(BB) != CurLoop) continue;
+            for (Instruction &I : llvm::make_early_inc_range(llvm::reverse(*BB))) {
+                if (!canSink(&I)) continue;
+
+                SmallVector<std::pair<Use*, BasicBlock*>, 8> uses;
+                MapVector<BasicBlock*, Instruction*> targets;
+                for (Use &U : I.uses()) {
+                    BasicBlock *target = getSinkTarget(U);
+                    if (!target) break;
+                    uses.push_back({&U, target});
+                    targets.insert({target, nullptr});
+                }
+                if (uses.empty() || uses.size() != I.getNumUses()) continue;
+
+                int64_t saved = blockCount(BB);
+                int64_t cost = 0;
+                for (auto &target : targets) cost += blockCount(target.first);
+                if (cost >= saved) continue;
+
+                ++NumSunk;
+                ORE->emit([&]() {
+                    return OptimizationRemark(DEBUG_TYPE, "Sunk", &I)
+                           << "sunk into " << ore::NV("Blocks", (int64_t)targets.size())
+                           << " infrequent or exit blocks";
+                });
+                for (auto &target : targets) {
+                    Instruction *copy = I.clone();
+                    copy->setName(I.getName() + ".sink");
+                    copy->insertBefore(&*target.first->getFirstInsertionPt());
+                    if (isa<LoadInst>(copy)) {
+                        auto *MA = MSSAU.createMemoryAccessInBB(copy, nullptr, target.first, MemorySSA::Beginning);
+                        MSSAU.insertUse(cast<MemoryUse>(MA), /*RenameUses=*/true);
                     }
-                    prev = curr;
+                    target.second = copy;
+                    left_loop |= !CurLoop->contains(target.first);
                 }
-                Icurr->insertBefore(store);
+                for (auto &use : uses) {
+                    Instruction *copy = targets[use.second];
+                    // The exit block copy takes over from the LCSSA phi.
+                    auto *PN = dyn_cast<PHINode>(use.first->getUser());
+                    if (PN && !CurLoop->contains(PN)) {
+                        PN->replaceAllUsesWith(copy);
+                        PN->eraseFromParent();
+                    } else {
+                        use.first->set(copy);
+                    }
+                }
+                if (isa<LoadInst>(&I)) MSSAU.removeMemoryAccess(&I);
+                I.eraseFromParent();
+                changed = true;
             }
-            store->eraseFromParent();
         }
+
+        // Copies in the exit blocks may read values defined in the loop.
+        if (left_loop) formLCSSA(*CurLoop, DT, LI, &SE);
+        return changed;
+    }
+
+    /// Instructions that compute the same value wherever they run: no side
+    /// effects, no convergent calls, and no memory reads other than loads of
+    /// locations the loop never writes.
+    bool canSink(Instruction *I) {
+        if (isa<PHINode>(I) || I->isTerminator() || I->isEHPad() || isa<AllocaInst>(I)
+            || isa<DbgInfoIntrinsic>(I) || I->getType()->isTokenTy() || I->mayHaveSideEffects())
+            return false;
+        if (auto *CB = dyn_cast<CallBase>(I))
+            if (CB->isConvergent()) return false;
+        if (auto *li = dyn_cast<LoadInst>(I))
+            return li->isSimple() && loop_writers.get(MemoryLocation::get(li), AA).empty();
+        return !I->mayReadFromMemory();
+    }
+
+    /// The block a copy has to be placed in for \p U: the user's block, or
+    /// the incoming block for a phi. That must be an infrequent block of this
+    /// loop, not of a subloop, or an exit block only entered from the loop,
+    /// where the use can only be an LCSSA phi. Returns null otherwise.
+    BasicBlock *getSinkTarget(Use &U) {
+        auto *User = cast<Instruction>(U.getUser());
+        BasicBlock *BB = User->getParent();
+        if (auto *PN = dyn_cast<PHINode>(User))
+            if (CurLoop->contains(PN)) BB = PN->getIncomingBlock(U);
+        if (BB->isEHPad()) return nullptr;
+        if (CurLoop->contains(BB))
+            return isInfrequent(BB) && LI->getLoopFor(BB) == CurLoop ? BB : nullptr;
+        BasicBlock *Pred = BB->getSinglePredecessor();
+        return Pred && CurLoop->contains(Pred) ? BB : nullptr;
     }
 
-    static void ConstantFolding(BasicBlock* cur_bb, BasicBlock* PreHeader) {
+    /// Promote every stack slot whose loop accesses are simple loads and
+    /// stores of one invariant pointer, written only on the infrequent path
+    /// and touched by nothing else in the loop: one load in the preheader,
+    /// SSA values inside the loop, and a store in each exit block. Only
+    /// slots that do not escape qualify, since the exit stores also run
+    /// when no infrequent write did.
+    bool promoteLocations(BasicBlock *PreHeader) {
+        SmallVector<BasicBlock*, 8> Exits;
+        CurLoop->getUniqueExitBlocks(Exits);
+        if (!CurLoop->hasDedicatedExits()
+            || llvm::any_of(Exits, [](BasicBlock *Exit) { return Exit->isEHPad(); }))
+            return false;
+
+        MapVector<Value*, OperandInfo> info;
+        std::vector<Instruction*> accesses;
+        for (auto *BB : CurLoop->getBlocks()) {
+            for (auto &I : *BB) {
+                if (!I.mayReadOrWriteMemory()) continue;
+                accesses.push_back(&I);
+                Value *ptr = getLoadStorePointerOperand(&I);
+                if (!ptr || !CurLoop->isLoopInvariant(ptr)) continue;
+                auto *slot = dyn_cast<AllocaInst>(getUnderlyingObject(ptr));
+                if (!slot || PointerMayBeCaptured(slot, true, true)) continue;
+                info.insert(std::make_pair(ptr, OperandInfo(ptr))).first->second.Insert(&I);
+            }
+        }
+
+        bool changed = false;
+        for (auto &ite : info) {
+            OperandInfo &group = ite.second;
+            if (group.stores.empty()) continue;
+            Type *Ty = getLoadStoreType(group.stores.front());
+            bool promotable = true;
+            for (auto *store : group.stores)
+                promotable &= store->isSimple() && isInfrequent(store->getParent())
+                              && store->getValueOperand() != group.operand && getLoadStoreType(store) == Ty;
+            for (auto *load : group.loads)
+                promotable &= load->isSimple() && getLoadStoreType(load) == Ty;
+            if (!promotable) continue;
+
+            // Nothing else in the loop may read or write the location.
+            MemoryLocation Loc = MemoryLocation::get(group.stores.front());
+            SmallPtrSet<Instruction*, 8> own(group.loads.begin(), group.loads.end());
+            own.insert(group.stores.begin(), group.stores.end());
+            if (llvm::any_of(accesses, [&](Instruction *I) {
+                    return !own.count(I) && isModOrRefSet(AA.getModRefInfo(I, Loc));
+                }))
+                continue;
+
+            SmallVector<Instruction*, 16> uses(group.loads.begin(), group.loads.end());
+            uses.append(group.stores.begin(), group.stores.end());
+            SmallVector<const Instruction*, 16> const_uses(uses.begin(), uses.end());
+            SmallVector<PHINode*, 16> new_phis;
+            SSAUpdater SSA(&new_phis);
+            LoopPromoter Promoter(const_uses, SSA, group, Exits, MSSAU);
+
+            StoreInst *first = group.stores.front();
+            auto *promoted = new LoadInst(Ty, group.operand, group.operand->getName() + ".promoted",
+                                          first->isVolatile(), first->getAlign(), PreHeader->getTerminator());
+            auto *MA = MSSAU.createMemoryAccessInBB(promoted, nullptr, PreHeader, MemorySSA::BeforeTerminator);
+            MSSAU.insertUse(cast<MemoryUse>(MA), /*RenameUses=*/true);
+            SSA.AddAvailableValue(PreHeader, promoted);
+            ORE->emit([&]() {
+                return OptimizationRemark(DEBUG_TYPE, "Promoted", first)
+                       << "promoted " << ore::NV("Location", group.operand->getName()) << " to a register, "
+                       << ore::NV("Stores", (int64_t)group.stores.size()) << " stores moved to the exits";
+            });
+            Promoter.run(uses);
+            llvm::erase_if(accesses, [&](Instruction *I) { return own.count(I); });
+            ++NumPromoted;
+            changed = true;
+        }
+
+        // The exit stores read values defined in the loop.
+        if (changed) formLCSSA(*CurLoop, DT, LI, nullptr);
+        return changed;
+    }
+
+    /// Forward stores to stack slots that live entirely in \p cur_bb into
+    /// their loads. Returns true if any slot was removed.
+    bool ConstantFolding(BasicBlock* cur_bb) {
+        bool changed = false;
         std::vector<Instruction*> loads;
         std::vector<Instruction*> stores;
-//        std::set<Value*> meet;
         for (auto &I: *cur_bb) {
             if (I.getOpcode() == Instruction::Store) stores.push_back(&I);
         }
         for (auto store : stores) {
-            for (auto usr : store->getOperand(1)->users()) {
-                auto load = dyn_cast<Instruction>(usr);
-                if (store == load || load->getParent() != cur_bb) continue; // usr may be store itself
+            // Only forward into stack slots that live entirely in this block
+            // and are written once, before every read.
+            auto *slot = dyn_cast<AllocaInst>(store->getOperand(1));
+            if (!slot) continue;
+            bool local = true;
+            for (auto usr : slot->users()) {
+                auto load = dyn_cast<LoadInst>(usr);
+                if (usr == store) continue; // usr may be store itself
+                if (!load || load->getParent() != cur_bb || !store->comesBefore(load)) {
+                    local = false;
+                    break;
+                }
                 loads.push_back(load);
             }
-            if (!loads.empty()) {
-//                auto insert_position = PreHeader->getTerminator()->getPrevNode();
-//                auto cur = dyn_cast<Instruction>(store->getOperand(0));
-//                Value *right;
-//                meet.insert(cur);
-//
-//                while (cur != nullptr) {
-//                    if (meet.find(cur) != meet.end()) {
-////                        backward.push(cur);
-//                        cur->moveAfter(insert_position);
-//                        meet.insert(cur->getOperand(0));
-//                        if (cur->getNumOperands() == 2) {
-//                            right = cur->getOperand(1);
-//                            if (dyn_cast<Instruction>(right) != nullptr)
-//                                meet.insert(right);
-//                        }else if (cur->getNumOperands() == 3){
-//                            right = cur->getOperand(2);
-//                            if (dyn_cast<Instruction>(right) != nullptr)
-//                                meet.insert(right);
-//                        }
-//                    }
-//                    cur = cur->getPrevNode();
-//                }
-
+            if (local && !loads.empty()) {
                 for (auto li : loads){
                     li->replaceAllUsesWith(store->getOperand(0));
+                    MSSAU.removeMemoryAccess(li);
                     li->eraseFromParent();
                 }
+                MSSAU.removeMemoryAccess(store);
                 store->eraseFromParent();
-                dyn_cast<Instruction>(store->getOperand(1))->eraseFromParent();
-                loads.clear();
-//                meet.clear();
+                slot->eraseFromParent();
+                changed = true;
             }
+            loads.clear();
         }
+        return changed;
+    }
+
+private:
+    /// The outermost subloop of the current loop that contains \p BB, or
+    /// null if \p BB belongs to the current loop itself.
+    Loop *getSubLoop(BasicBlock *BB) {
+        Loop *Sub = LI->getLoopFor(BB);
+        while (Sub && Sub->getParentLoop() != CurLoop) Sub = Sub->getParentLoop();
+        return Sub;
     }
 
-    static void ConstantFolding(BasicBlock* cur_bb, std::vector<Instruction*> &ins_list) {
+    bool isInfrequent(BasicBlock *BB) { return ifb.count(BB); }
+
+    AAResults &AA;
+    MemorySSA &MSSA;
+    MemorySSAUpdater MSSAU;
+    DominatorTree &DT;
+    ScalarEvolution &SE;
+    TargetLibraryInfo &TLI;
+    const TargetTransformInfo &TTI;
+    SimpleLoopSafetyInfo SafetyInfo;
+    Loop *CurLoop = nullptr;
+    LoopInfo *LI = nullptr;
+    BlockFrequencyInfo *BFI = nullptr;
+    BranchProbabilityInfo *BPI = nullptr;
+    int64_t added = 0;                                        // Instructions the fix-ups add to the loop
+    int64_t fixup_blocks = 0;                                 // Fix-up blocks shared by a cold region
+    std::vector<Instruction*> hoisted;                        // In topological order
+    DenseMap<Instruction*, Writes> clobbers;                  // Writes each hoisted value depends on
+    DenseMap<Instruction*, Loop*> levels;                     // Outermost loop each one leaves
+    SmallPtrSet<Instruction*, 8> unguarded;                   // May trap, only hoisted because the loop runs them
+    SmallPtrSet<Instruction*, 8> next_iteration;              // Read memory before the writes that change them
+    struct Estimate { int64_t saved, cost; };                 // Block counts, by isProfitable()
+    DenseMap<Instruction*, Estimate> estimates;
+    DenseSet<std::pair<Instruction*, Instruction*>> guarded;  // Load and store pairs checked at runtime
+    WriterIndex loop_writers;                                 // MemoryDefs of the loop
+    DenseMap<Loop*, WriterIndex> outer_writers;               // ... of enclosing loops, outside the inner one
+    OptimizationRemarkEmitter *ORE = nullptr;
+    SmallPtrSet<BasicBlock*, 32> fb;  // Frequent region
+    SmallPtrSet<BasicBlock*, 32> ifb; // Infrequent region
+};
+
+struct FPLICMPass : public LoopPass {
+    static char ID;
+    FPLICMPass() : LoopPass(ID) {}
+
+    bool runOnLoop(Loop *L, LPPassManager &LPM) override {
+        BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+        BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
+        LoopInfo &LoopInfo = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+        AAResults &AA = getAnalysis<AAResultsWrapperPass>().getAAResults();
+        MemorySSA &MSSA = getAnalysis<MemorySSAWrapperPass>().getMSSA();
+        DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+        ScalarEvolution &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+        Function &F = *L->getHeader()->getParent();
+        TargetLibraryInfo &TLI = getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(F);
+        bool profiled = F.hasProfileData();
+        ProfileAnalyses Prof(F, LoopInfo, DT, SE, TLI, profiled ? &bfi : nullptr, profiled ? &bpi : nullptr);
+        const TargetTransformInfo &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+        FPLICMImpl Impl(AA, MSSA, DT, SE, TLI, TTI);
+        bool Changed = Impl.runOnLoop(L, *Prof.BFI, *Prof.BPI, LoopInfo);
+        if (Impl.SlowLoop) LPM.addLoop(*Impl.SlowLoop);
+        return Changed;
+    }
 
-        std::vector<std::pair<Instruction*,Instruction*>> store_load;
-        for (auto &I : *cur_bb) {
-            if (I.getOpcode() == Instruction::Store) {
-                for (auto usr : I.getOperand(1)->users()) {
-                    // assert((dyn_cast<Instruction>(usr)->getParent() == cur_bb) && "load store pair should be in the same BB");
-                    if (&I != dyn_cast<Instruction>(usr) && dyn_cast<Instruction>(usr)->getParent() == cur_bb)
-                        store_load.emplace_back(&I, dyn_cast<Instruction>(usr));
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        AU.addRequired<BranchProbabilityInfoWrapperPass>();
+        AU.addRequired<BlockFrequencyInfoWrapperPass>();
+        AU.addRequired<LoopInfoWrapperPass>();
+        AU.addRequired<AAResultsWrapperPass>();
+        AU.addRequired<MemorySSAWrapperPass>();
+        AU.addRequired<DominatorTreeWrapperPass>();
+        AU.addRequired<ScalarEvolutionWrapperPass>();
+        AU.addRequired<TargetLibraryInfoWrapperPass>();
+        AU.addRequired<TargetTransformInfoWrapperPass>();
+        AU.addPreserved<MemorySSAWrapperPass>();
+        AU.addPreserved<LoopInfoWrapperPass>();
+        AU.addPreserved<DominatorTreeWrapperPass>();
+    }
+};
+
+/// New pass manager version of the performance pass. Hoisting only moves and
+/// clones instructions inside existing blocks; loop versioning keeps the
+/// dominator tree and loop info up to date and reports the new loop.
+/// MemorySSA is updated along the way.
+struct NewFPLICMPass : public PassInfoMixin<NewFPLICMPass> {
+    PreservedAnalyses run(Loop &L, LoopAnalysisManager &AM, LoopStandardAnalysisResults &AR, LPMUpdater &U) {
+        ProfileAnalyses Prof(L, AR);
+        // Outside of loop-mssa(...) pipelines, build a throwaway MemorySSA.
+        std::unique_ptr<MemorySSA> OwnedMSSA;
+        MemorySSA *MSSA = AR.MSSA;
+        if (!MSSA) {
+            OwnedMSSA = std::make_unique<MemorySSA>(*L.getHeader()->getParent(), &AR.AA, &AR.DT);
+            MSSA = OwnedMSSA.get();
+        }
+        FPLICMImpl Impl(AR.AA, *MSSA, AR.DT, AR.SE, AR.TLI, AR.TTI);
+        if (!Impl.runOnLoop(&L, *Prof.BFI, *Prof.BPI, AR.LI)) return PreservedAnalyses::all();
+        if (Impl.SlowLoop) U.addSiblingLoops({Impl.SlowLoop});
+        AR.SE.forgetLoop(&L);
+        auto PA = getLoopPassPreservedAnalyses();
+        if (AR.MSSA) PA.preserve<MemorySSAAnalysis>();
+        return PA;
+    }
+
+    // The benchmark bitcode comes from clang -O0 and is marked optnone.
+    static bool isRequired() { return true; }
+};
+
+/// Runs after FPLICM, right before the vectorizer. The cold path of a loop is
+/// often a branch on the induction variable, like `if (i < 3)`, that only
+/// goes one way in the first few iterations. Peeling those off leaves a
+/// steady-state loop where the branch is constant, so the cold blocks and
+/// the values only they change drop out, and the loop can be vectorized.
+struct PeelColdPrefixPass : public PassInfoMixin<PeelColdPrefixPass> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        if (!MaxPeel) return PreservedAnalyses::all();
+        auto &LI = AM.getResult<LoopAnalysis>(F);
+        auto &DT = AM.getResult<DominatorTreeAnalysis>(F);
+        auto &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+        auto &AC = AM.getResult<AssumptionAnalysis>(F);
+        auto &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+
+        bool changed = false;
+        for (Loop *L : LI.getLoopsInPreorder()) {
+            SmallVector<BranchInst*, 4> guards;
+            unsigned count = getPeelCount(L, SE, guards);
+            if (!count || !peelLoop(L, count, &LI, &SE, DT, &AC, /*PreserveLCSSA=*/true)) continue;
+            changed = true;
+            ++NumPeeled;
+            ORE.emit([&]() {
+                return OptimizationRemark(DEBUG_TYPE, "Peeled", L->getStartLoc(), L->getHeader())
+                       << "peeled " << ore::NV("Count", count) << " iterations, after which "
+                       << ore::NV("Branches", (unsigned)guards.size()) << " branches on the induction variable "
+                       << "always go the same way";
+            });
+            // Recheck in the steady-state loop, which starts after them.
+            auto TC = SE.getSmallConstantMaxTripCount(L);
+            for (auto *BI : guards) {
+                auto G = evaluateGuard(cast<ICmpInst>(BI->getCondition()), L, SE, TC);
+                if (G && G->Iterations == TC && G->Changes == TC) {
+                    Value *Cmp = BI->getCondition();
+                    BI->setCondition(ConstantInt::getBool(F.getContext(), G->First));
+                    RecursivelyDeleteTriviallyDeadInstructions(Cmp);
                 }
             }
         }
-        std::deque<Instruction*> bfs;
-        for (auto &sl : store_load) {
-            std::stack<Instruction*> backward;
-            std::set<Value*> meet;
-            Value *right;
-            // add backword instuctions
-            auto cur = dyn_cast<Instruction>(sl.first->getOperand(0));
-            meet.insert(cur);
-
-            while (cur != nullptr) {
-                if (meet.find(cur) != meet.end()) {
-                    backward.push(cur);
-                    meet.insert(cur->getOperand(0));
-                    if (cur->getNumOperands() == 2) {
-                        right = cur->getOperand(1);
-                        if (dyn_cast<Instruction>(right) != nullptr)
-                            meet.insert(right);
-                    }else if (cur->getNumOperands() == 3){
-                        right = cur->getOperand(2);
-                        if (dyn_cast<Instruction>(right) != nullptr)
-                            meet.insert(right);
+        if (!changed) return PreservedAnalyses::all();
+
+        // Drop the cold blocks, then the phis that only merged their values.
+        for (auto &BB : F) ConstantFoldTerminator(&BB, /*DeleteDeadConditions=*/true);
+        removeUnreachableBlocks(F);
+        const SimplifyQuery SQ(F.getParent()->getDataLayout());
+        for (bool simplified = true; simplified;) {
+            simplified = false;
+            for (auto &BB : F)
+                for (auto &PN : make_early_inc_range(BB.phis()))
+                    if (Value *V = SimplifyInstruction(&PN, SQ)) {
+                        PN.replaceAllUsesWith(V);
+                        PN.eraseFromParent();
+                        simplified = true;
                     }
-                }
-                cur = cur->getPrevNode();
+        }
+        return PreservedAnalyses::none();
+    }
+
+    /// The iterations to peel off \p L so that each branch in \p Guards,
+    /// those on a register induction variable that change direction once
+    /// in the first MaxPeel iterations, keeps one direction after that.
+    static unsigned getPeelCount(Loop *L, ScalarEvolution &SE, SmallVectorImpl<BranchInst*> &Guards) {
+        unsigned TC = SE.getSmallConstantMaxTripCount(L);
+        if (!L->isInnermost() || !TC || !canPeel(L)) return 0;
+        unsigned count = 0;
+        for (auto *BB : L->blocks()) {
+            auto *BI = dyn_cast<BranchInst>(BB->getTerminator());
+            auto *Cmp = BI && BI->isConditional() && !L->isLoopExiting(BB) ? dyn_cast<ICmpInst>(BI->getCondition()) : nullptr;
+            if (!Cmp || !(isa<SCEVAddRecExpr>(SE.getSCEV(Cmp->getOperand(0))) ||
+                          isa<SCEVAddRecExpr>(SE.getSCEV(Cmp->getOperand(1)))))
+                continue;
+            auto G = evaluateGuard(Cmp, L, SE, TC);
+            if (!G || G->Iterations < TC || G->Changes >= TC || G->Changes > MaxPeel) continue;
+            // One change for good: it takes the first direction exactly until then.
+            if (G->Taken != (G->First ? G->Changes : TC - G->Changes)) continue;
+            count = std::max<unsigned>(count, G->Changes);
+            Guards.push_back(BI);
+        }
+        return count;
+    }
+};
+
+/// Runs after FPLICM. Each cold region of a loop, blocks on its infrequent
+/// path together with the fix-ups placed in them or on their way back, moves
+/// into a cold, never inlined function in .text.unlikely. What stays in the
+/// loop is the frequent path and a call.
+struct OutlineColdRegionsPass : public PassInfoMixin<OutlineColdRegionsPass> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+        auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        // Not the functions outlining adds.
+        SmallVector<Function*, 16> functions;
+        for (auto &F : M)
+            if (!F.isDeclaration()) functions.push_back(&F);
+        bool changed = false;
+        for (Function *F : functions)
+            if (outlineColdRegions(*F, FAM)) {
+                FAM.invalidate(*F, PreservedAnalyses::none());
+                changed = true;
             }
-            errs() << "+++++++++++++++\n";
-            while (!backward.empty()) {
-                errs() << *backward.top() << "\n";
-                ins_list.push_back(backward.top());
-                backward.pop();
+        return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+
+    /// Blocks are cold as in FPLICM: in fewer than 1 - threshold of the
+    /// iterations of their innermost loop. A cold block entered from the
+    /// rest of the loop heads a region, the cold blocks it reaches and
+    /// dominates. All regions are found first; extraction only keeps the
+    /// dominator tree up to date.
+    static bool outlineColdRegions(Function &F, FunctionAnalysisManager &FAM) {
+        auto &LI = FAM.getResult<LoopAnalysis>(F);
+        if (LI.empty()) return false;
+        auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+        bool profiled = F.hasProfileData();
+        ProfileAnalyses Prof(F, LI, DT, FAM.getResult<ScalarEvolutionAnalysis>(F),
+                             FAM.getResult<TargetLibraryAnalysis>(F),
+                             profiled ? &FAM.getResult<BlockFrequencyAnalysis>(F) : nullptr,
+                             profiled ? &FAM.getResult<BranchProbabilityAnalysis>(F) : nullptr);
+        OptimizationRemarkEmitter ORE(&F);
+
+        std::vector<SmallVector<BasicBlock*, 8>> regions;
+        for (Loop *L : LI.getLoopsInPreorder()) {
+            double cold = (1 - getThreshold(L, LI)) * Prof.BFI->getBlockFreq(L->getHeader()).getFrequency();
+            SmallPtrSet<BasicBlock*, 16> cold_blocks;
+            for (auto *BB : L->blocks())
+                if (LI.getLoopFor(BB) == L && BB != L->getHeader()
+                    && Prof.BFI->getBlockFreq(BB).getFrequency() < cold)
+                    cold_blocks.insert(BB);
+            for (auto *Node : depth_first(DT.getNode(L->getHeader()))) {
+                BasicBlock *Entry = Node->getBlock();
+                if (!cold_blocks.count(Entry)
+                    || all_of(predecessors(Entry), [&](BasicBlock *P) { return cold_blocks.count(P); }))
+                    continue;
+                SmallVector<BasicBlock*, 8> region{Entry};
+                cold_blocks.erase(Entry);
+                for (unsigned i = 0; i < region.size(); ++i)
+                    for (auto *Succ : successors(region[i]))
+                        if (cold_blocks.count(Succ) && DT.dominates(Entry, Succ)) {
+                            cold_blocks.erase(Succ);
+                            region.push_back(Succ);
+                        }
+                unsigned size = 0;
+                for (auto *BB : region) size += BB->sizeWithoutDebug() - 1;
+                if (size >= OutlineMinSize) regions.push_back(region);
             }
-            errs() << "+++++++++++++++\n";
+        }
 
-            sl.second->replaceAllUsesWith(sl.first->getOperand(0));
-            sl.first->eraseFromParent();
-            sl.second->eraseFromParent();
-//            dyn_cast<Instruction>(sl.first->getOperand(1))->eraseFromParent();
+        bool changed = false;
+        CodeExtractorAnalysisCache CEAC(F);
+        for (auto &region : regions) {
+            CodeExtractor CE(region, &DT, /*AggregateArgs=*/false, Prof.BFI, Prof.BPI, /*AC=*/nullptr,
+                             /*AllowVarArgs=*/false, /*AllowAlloca=*/false, "cold");
+            Function *Cold = CE.isEligible() ? CE.extractCodeRegion(CEAC) : nullptr;
+            if (!Cold) {
+                ORE.emit([&]() {
+                    return OptimizationRemarkMissed(DEBUG_TYPE, "NotOutlined", &region.front()->front())
+                           << "cold region not outlined: it has more than one entry or cannot be extracted";
+                });
+                continue;
+            }
+            Cold->addFnAttr(Attribute::Cold);
+            Cold->addFnAttr(Attribute::NoInline);
+            Cold->setSectionPrefix("unlikely");
+            auto *Call = cast<CallBase>(Cold->user_back());
+            Call->setIsNoInline();
+            changed = true;
+            ++NumOutlined;
+            ORE.emit([&]() {
+                return OptimizationRemark(DEBUG_TYPE, "Outlined", Call)
+                       << "outlined " << ore::NV("Blocks", (unsigned)region.size()) << " cold blocks into "
+                       << ore::NV("Function", Cold);
+            });
+        }
+        return changed;
     }
-}
 
-void getAnalysisUsage(AnalysisUsage &AU) const override {
-    AU.addRequired<BranchProbabilityInfoWrapperPass>();
-    AU.addRequired<BlockFrequencyInfoWrapperPass>();
-    AU.addRequired<LoopInfoWrapperPass>();
-}
+    static bool isRequired() { return true; }
+};
 
-private:
-    /// Little predicate that returns true if the specified basic block is in
-    /// a subloop of the current one, not the current one itself.
-    bool inSubLoop(BasicBlock *BB, Loop *CurLoop, LoopInfo *LI) {
-        assert(CurLoop->contains(BB) && "Only valid if BB is IN the loop");
-        return LI->getLoopFor(BB) != CurLoop && BB != LI->getLoopFor(BB)->getHeader();
+/// Value profiling, the instrumented half: every load getValueProfileSites()
+/// covers reports the value it read to __fplicm_value_prof(), with the entry
+/// of a table that benchmarks/valueprof.c fills and writes out at exit.
+struct ValueProfileGenPass : public PassInfoMixin<ValueProfileGenPass> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+        auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        LLVMContext &C = M.getContext();
+        IRBuilder<> B(C);
+        Type *I64 = B.getInt64Ty();
+        // Function name, load number, loads of the function, then the
+        // counters of the runtime: value, votes, hits, total, changes, last.
+        SmallVector<Type*, 9> fields{B.getInt8PtrTy()};
+        fields.append(8, I64);
+        auto *SiteTy = StructType::create(C, fields, "fplicm.value_site");
+
+        std::vector<Constant*> sites;
+        std::vector<LoadInst*> probes;
+        for (auto &F : M) {
+            if (F.isDeclaration()) continue;
+            auto loads = getValueProfileSites(F, FAM.getResult<LoopAnalysis>(F));
+            if (loads.empty()) continue;
+            Constant *name = B.CreateGlobalStringPtr(F.getName(), "fplicm.name", 0, &M);
+            for (unsigned i = 0; i < loads.size(); ++i) {
+                SmallVector<Constant*, 9> init{name, ConstantInt::get(I64, i), ConstantInt::get(I64, loads.size())};
+                init.append(6, ConstantInt::get(I64, 0));
+                sites.push_back(ConstantStruct::get(SiteTy, init));
+                probes.push_back(loads[i]);
+            }
+        }
+        if (sites.empty()) return PreservedAnalyses::all();
+
+        auto *TableTy = ArrayType::get(SiteTy, sites.size());
+        auto *Table = new GlobalVariable(M, TableTy, false, GlobalValue::PrivateLinkage,
+                                         ConstantArray::get(TableTy, sites), "fplicm.value_sites");
+        FunctionCallee Probe = M.getOrInsertFunction("__fplicm_value_prof", B.getVoidTy(), SiteTy->getPointerTo(), I64);
+        for (unsigned i = 0; i < probes.size(); ++i) {
+            B.SetInsertPoint(probes[i]->getNextNode());
+            B.CreateCall(Probe, {B.CreateConstInBoundsGEP2_32(TableTy, Table, 0, i),
+                                 B.CreateSExt(probes[i], I64)});
+        }
+
+        // Hand the table to the runtime before main.
+        FunctionCallee Init = M.getOrInsertFunction("__fplicm_value_prof_init", B.getVoidTy(),
+                                                    SiteTy->getPointerTo(), I64);
+        auto *Ctor = Function::Create(FunctionType::get(B.getVoidTy(), false), GlobalValue::InternalLinkage,
+                                      "fplicm.value_prof.init", M);
+        B.SetInsertPoint(BasicBlock::Create(C, "entry", Ctor));
+        B.CreateCall(Init, {B.CreateConstInBoundsGEP2_32(TableTy, Table, 0, 0), ConstantInt::get(I64, sites.size())});
+        B.CreateRetVoid();
+        appendToGlobalCtors(M, Ctor, 0);
+        return PreservedAnalyses::none();
+    }
+
+    static bool isRequired() { return true; }
+};
+
+/// Value profiling, the other half: attaches the dominant value of each
+/// load in the -fplicm-value-profile file that reads it often enough, for
+/// FPLICM to specialize its loop on. Functions with another number of loads
+/// than when they were profiled are left alone.
+struct ValueProfileUsePass : public PassInfoMixin<ValueProfileUsePass> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+        auto Buffer = MemoryBuffer::getFile(ValueProfileFile);
+        if (!Buffer) report_fatal_error("Cannot read value profile " + Twine(ValueProfileFile));
+
+        // One line per load: function load loads value hits total changes
+        struct Site { int64_t index, loads, value, hits, total; };
+        StringMap<SmallVector<Site, 8>> profile;
+        SmallVector<StringRef, 64> lines;
+        (*Buffer)->getBuffer().split(lines, '\n', -1, /*KeepEmpty=*/false);
+        for (StringRef line : lines) {
+            SmallVector<StringRef, 7> f;
+            line.split(f, ' ', -1, /*KeepEmpty=*/false);
+            Site site;
+            if (f.size() != 7 || f[1].getAsInteger(10, site.index) || f[2].getAsInteger(10, site.loads)
+                || f[3].getAsInteger(10, site.value) || f[4].getAsInteger(10, site.hits)
+                || f[5].getAsInteger(10, site.total))
+                report_fatal_error("Bad value profile line " + line);
+            profile[f[0]].push_back(site);
+        }
+
+        auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        Type *I64 = Type::getInt64Ty(M.getContext());
+        for (auto &F : M) {
+            auto it = profile.find(F.getName());
+            if (F.isDeclaration() || it == profile.end()) continue;
+            auto loads = getValueProfileSites(F, FAM.getResult<LoopAnalysis>(F));
+            for (auto &site : it->second) {
+                if (site.loads != (int64_t)loads.size() || site.index < 0 || site.index >= site.loads) break;
+                if (!site.total || site.hits < ValueStability * site.total) continue;
+                LoadInst *li = loads[site.index];
+                auto *V = ConstantInt::getSigned(cast<IntegerType>(li->getType()), site.value);
+                li->setMetadata(ValueProfileMD, MDNode::get(M.getContext(), {
+                    ConstantAsMetadata::get(V), ConstantAsMetadata::get(ConstantInt::get(I64, site.hits)),
+                    ConstantAsMetadata::get(ConstantInt::get(I64, site.total))}));
+            }
+        }
+        return PreservedAnalyses::all();
     }
 
+    static bool isRequired() { return true; }
 };
 } // end of namespace Performance
 
 char Performance::FPLICMPass::ID = 0;
 static RegisterPass<Performance::FPLICMPass> Y("fplicm-performance", "Frequent Loop Invariant Code Motion for performance test",
                                                false, false);
+
+
+/// Build a function level adaptor that computes the analyses FPLICM reads, so
+/// the pass can be used directly in a function pipeline.
+template <typename LoopPassT>
+static void addFPLICMAdaptor(FunctionPassManager &FPM, bool UseMemorySSA) {
+    FPM.addPass(createFunctionToLoopPassAdaptor(LoopPassT(), UseMemorySSA,
+                                                /*UseBlockFrequencyInfo=*/true,
+                                                /*UseBranchProbabilityInfo=*/true));
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
+    return {LLVM_PLUGIN_API_VERSION, "FPLICM", LLVM_VERSION_STRING, [](PassBuilder &PB) {
+        // -passes=fplicm-performance, or as part of a loop(...) pipeline.
+        PB.registerPipelineParsingCallback(
+            [](StringRef Name, LoopPassManager &LPM, ArrayRef<PassBuilder::PipelineElement>) {
+                if (Name == "fplicm-correctness") {
+                    LPM.addPass(Correctness::NewFPLICMPass());
+                    return true;
+                }
+                if (Name == "fplicm-performance") {
+                    LPM.addPass(Performance::NewFPLICMPass());
+                    return true;
+                }
+                return false;
+            });
+        PB.registerPipelineParsingCallback(
+            [](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>) {
+                if (Name == "fplicm-peel") {
+                    FPM.addPass(Performance::PeelColdPrefixPass());
+                    return true;
+                }
+                if (Name == "fplicm-correctness") {
+                    addFPLICMAdaptor<Correctness::NewFPLICMPass>(FPM, /*UseMemorySSA=*/false);
+                    return true;
+                }
+                if (Name == "fplicm-performance") {
+                    addFPLICMAdaptor<Performance::NewFPLICMPass>(FPM, /*UseMemorySSA=*/true);
+                    return true;
+                }
+                return false;
+            });
+        // After module passes, e.g. -passes=pgo-instr-use,fplicm-performance.
+        PB.registerPipelineParsingCallback(
+            [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+                if (Name == "fplicm-value-prof-gen") {
+                    MPM.addPass(Performance::ValueProfileGenPass());
+                    return true;
+                }
+                if (Name == "fplicm-value-prof-use") {
+                    MPM.addPass(Performance::ValueProfileUsePass());
+                    return true;
+                }
+                if (Name == "fplicm-outline") {
+                    MPM.addPass(Performance::OutlineColdRegionsPass());
+                    return true;
+                }
+                FunctionPassManager FPM;
+                if (Name == "fplicm-peel")
+                    FPM.addPass(Performance::PeelColdPrefixPass());
+                else if (Name == "fplicm-correctness")
+                    addFPLICMAdaptor<Correctness::NewFPLICMPass>(FPM, /*UseMemorySSA=*/false);
+                else if (Name == "fplicm-performance")
+                    addFPLICMAdaptor<Performance::NewFPLICMPass>(FPM, /*UseMemorySSA=*/true);
+                else
+                    return false;
+                MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+                return true;
+            });
+        // Loop invariant code motion has run by now, and the vectorizer is next.
+        PB.registerVectorizerStartEPCallback(
+            [](FunctionPassManager &FPM, OptimizationLevel Level) {
+                if (!EnableFPLICMInPipeline) return;
+                addFPLICMAdaptor<Performance::NewFPLICMPass>(FPM, /*UseMemorySSA=*/true);
+                FPM.addPass(Performance::PeelColdPrefixPass());
+            });
+    }};
+}
@@ -0,0 +1,100 @@
+#!/bin/bash
+# Benchmark harness: builds the baseline and the FPLICM binary of each
+# benchmark once, checks that they print the same, then runs both with
+# perfrun and writes median, 95% confidence interval and hardware counters
+# (instructions, cycles, loads, L1 instruction cache misses) of every run to
+# a JSON file.
+# Usage: ./bench.sh [-n runs] [-w warmups] [-o out.json] [benchmark...]
+#        (default: 10 runs, 1 warm-up, bench.json, every benchmark)
+# Set PATH2LIB to the plugin and PASS to the pass to measure, e.g.
+# PASS=fplicm-performance,fplicm-outline to outline the cold paths as well.
+HERE=$(cd "$(dirname "$0")" && pwd)
+PATH2LIB=${PATH2LIB:-$HERE/../build/HW2/LLVMHW2.so}
+PASS=${PASS:-fplicm-performance}
+CC=${CC:-clang}
+WORK=${WORK:-${TMPDIR:-/tmp}/fplicm-bench}
+
+RUNS=10
+WARMUPS=1
+OUT=bench.json
+while getopts "n:w:o:" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        w) WARMUPS=$OPTARG ;;
+        o) OUT=$OPTARG ;;
+        *) exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+BENCHMARKS=${@:-$(cd "$HERE" && ls correctness/*.c performance/*.c 2>/dev/null | sed 's/\.c$//')}
+
+[ -f "$PATH2LIB" ] || { echo "No plugin at $PATH2LIB, set PATH2LIB" >&2; exit 1; }
+mkdir -p "$WORK"
+cc -O2 -o "$WORK/perfrun" "$HERE/perfrun.c" -lm || exit 1
+
+# Same steps as run.sh: profile the loop-simplified code, then apply the
+# pass with that profile.
+build() {
+    local src=$1 name=$2
+    $CC -emit-llvm -c "$src" -o $name.bc &&
+    opt -passes=loop-simplify $name.bc -o $name.ls.bc &&
+    opt -passes=pgo-instr-gen,instrprof $name.ls.bc -o $name.ls.prof.bc &&
+    $CC -fprofile-instr-generate $name.ls.prof.bc -o ${name}_prof &&
+    LLVM_PROFILE_FILE=$name.profraw ./${name}_prof > ${name}_correct_output &&
+    llvm-profdata merge -o $name.profdata $name.profraw &&
+    opt -pgo-test-profile-file=$name.profdata -load-pass-plugin "$PATH2LIB" -passes=pgo-instr-use,$PASS \
+        $name.ls.bc -o $name.fplicm.bc &&
+    $CC $name.ls.bc -o ${name}_no_fplicm &&
+    $CC $name.fplicm.bc -o ${name}_fplicm
+}
+
+# median <json> [metric]: the median of wall_s or another metric, or null.
+median() { grep -o "\"${2:-wall_s}\": [^,]*" "$1" | sed 's/.*: //' | head -1; }
+
+commit=$(git -C "$HERE" rev-parse HEAD 2>/dev/null)
+{
+    echo "{"
+    echo "  \"commit\": \"$commit\","
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "  \"pass\": \"$PASS\","
+    echo "  \"benchmarks\": {"
+} > "$OUT"
+
+printf "%-14s %8s %12s %12s %8s %12s %12s\n" benchmark status baseline fplicm speedup "i\$-miss base" "i\$-miss fplicm"
+first=1
+for bench in $BENCHMARKS; do
+    name=$(basename $bench)
+    (cd "$WORK" && build "$HERE/$bench.c" $name) > "$WORK/$name.log" 2>&1 || {
+        printf "%-14s %8s  (see %s)\n" $name BUILD-FAIL "$WORK/$name.log"
+        continue
+    }
+    (cd "$WORK" && ./${name}_fplicm > ${name}_fplicm_output)
+    if ! cmp -s "$WORK/${name}_correct_output" "$WORK/${name}_fplicm_output"; then
+        printf "%-14s %8s\n" $name FAIL
+        correct=false
+    else
+        correct=true
+    fi
+    "$WORK/perfrun" -n $RUNS -w $WARMUPS -- "$WORK/${name}_no_fplicm" > "$WORK/$name.base.json" || continue
+    "$WORK/perfrun" -n $RUNS -w $WARMUPS -- "$WORK/${name}_fplicm" > "$WORK/$name.fplicm.json" || continue
+
+    base=$(median "$WORK/$name.base.json")
+    fast=$(median "$WORK/$name.fplicm.json")
+    speedup=$(awk -v b=$base -v o=$fast 'BEGIN { printf "%.3f", (o > 0 ? b / o : 0) }')
+    $correct && printf "%-14s %8s %11.4fs %11.4fs %7sx %12s %12s\n" $name PASS $base $fast $speedup \
+        $(median "$WORK/$name.base.json" icache_misses) $(median "$WORK/$name.fplicm.json" icache_misses)
+
+    [ $first = 1 ] || echo "    ," >> "$OUT"
+    first=0
+    {
+        echo "    \"$name\": {"
+        echo "      \"correct\": $correct,"
+        echo "      \"speedup\": $speedup,"
+        echo "      \"baseline\": $(sed 's/^/      /' "$WORK/$name.base.json" | sed '1s/^ *//'),"
+        echo "      \"fplicm\": $(sed 's/^/      /' "$WORK/$name.fplicm.json" | sed '1s/^ *//')"
+        echo "    }"
+    } >> "$OUT"
+done
+echo "  }" >> "$OUT"
+echo "}" >> "$OUT"
+echo "Results written to $OUT"
@@ -0,0 +1,82 @@
+#!/bin/bash
+# Layout check: builds each benchmark with FPLICM like run.sh, then with
+# llc -O2, and checks the machine code after block placement: no two-way
+# branch may jump forward to a successor it takes in 80% or more of its
+# runs. The frequent path is then the fall-through chain, with only the
+# backedges jumping. Two-way branches in blocks FPLICM adds, named
+# *.fplicm.*, must also carry weights, not split 50/50.
+# Usage: ./layout.sh [benchmark...]   (default: every benchmark)
+# Set PATH2LIB to the plugin and PASS to the pass to check.
+HERE=$(cd "$(dirname "$0")" && pwd)
+PATH2LIB=${PATH2LIB:-$HERE/../build/HW2/LLVMHW2.so}
+PASS=${PASS:-fplicm-performance}
+CC=${CC:-clang}
+WORK=${WORK:-${TMPDIR:-/tmp}/fplicm-layout}
+BENCHMARKS=${@:-$(cd "$HERE" && ls correctness/*.c performance/*.c 2>/dev/null | sed 's/\.c$//')}
+
+[ -f "$PATH2LIB" ] || { echo "No plugin at $PATH2LIB, set PATH2LIB" >&2; exit 1; }
+mkdir -p "$WORK"
+
+# Without optnone, so that codegen places blocks.
+build() {
+    local src=$1 name=$2
+    $CC -emit-llvm -c -Xclang -disable-O0-optnone "$src" -o $name.bc &&
+    opt -passes=loop-simplify $name.bc -o $name.ls.bc &&
+    opt -passes=pgo-instr-gen,instrprof $name.ls.bc -o $name.ls.prof.bc &&
+    $CC -fprofile-instr-generate $name.ls.prof.bc -o ${name}_prof &&
+    LLVM_PROFILE_FILE=$name.profraw ./${name}_prof > /dev/null &&
+    llvm-profdata merge -o $name.profdata $name.profraw &&
+    opt -pgo-test-profile-file=$name.profdata -load-pass-plugin "$PATH2LIB" -passes=pgo-instr-use,$PASS \
+        $name.ls.bc -o $name.fplicm.bc &&
+    llc -O2 -stop-after=block-placement $name.fplicm.bc -o $name.mir
+}
+
+# Prints "function block -> successor" for every hot forward jump in the
+# MIR, and "function block unweighted" for the branches FPLICM added
+# without weights. Probabilities are fractions of 0x80000000.
+check() {
+    awk '
+    function hex(s,    v, i) {
+        v = 0
+        for (i = 3; i <= length(s); ++i) v = v * 16 + index("0123456789abcdef", tolower(substr(s, i, 1))) - 1
+        return v
+    }
+    /^name:/ { fn = $2; n = 0; split("", pos); split("", hot); split("", block) }
+    /^  bb\.[0-9]+/ { split($1, p, "."); cur = p[2]; pos[cur] = n++; block[cur] = $1; sub(/:$/, "", block[cur]) }
+    /^    successors:/ {
+        if (NF < 3) next
+        even = 1
+        for (i = 2; i <= NF; ++i) {
+            split($i, s, /[.(),]/)
+            if (hex(s[3]) >= 0.8 * 2147483648) hot[cur] = s[2]
+            if (hex(s[3]) != 1073741824) even = 0
+        }
+        if (even && NF == 3 && block[cur] ~ /\.fplicm\./) print fn " " block[cur] " unweighted"
+    }
+    /^\.\.\.$/ || /^---/ {
+        for (b in hot)
+            if (pos[hot[b]] > pos[b] + 1) print fn " " block[b] " -> bb." hot[b]
+        split("", hot)
+    }
+    END { for (b in hot) if (pos[hot[b]] > pos[b] + 1) print fn " " block[b] " -> bb." hot[b] }
+    ' "$1"
+}
+
+status=0
+for bench in $BENCHMARKS; do
+    name=$(basename $bench)
+    (cd "$WORK" && build "$HERE/$bench.c" $name) > "$WORK/$name.log" 2>&1 || {
+        echo "$name BUILD-FAIL (see $WORK/$name.log)"
+        status=1
+        continue
+    }
+    jumps=$(check "$WORK/$name.mir")
+    if [ -z "$jumps" ]; then
+        echo "$name PASS"
+    else
+        echo "$name FAIL: the frequent path jumps forward"
+        echo "$jumps" | sed 's/^/  /'
+        status=1
+    fi
+done
+exit $status
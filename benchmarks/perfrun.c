@@ -0,0 +1,145 @@
+// Runs a program several times and prints its wall time and hardware
+// counters as JSON: the median of each, with a 95% confidence interval.
+// Usage: perfrun [-n runs] [-w warmups] -- program [args...]
+// The program's output goes to /dev/null. Counters the kernel does not
+// allow (see /proc/sys/kernel/perf_event_paranoid) are reported as null.
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { WALL, INSTRUCTIONS, CYCLES, LOADS, ICACHE_MISSES, METRICS };
+static const char *names[METRICS] = {"wall_s", "instructions", "cycles", "loads", "icache_misses"};
+
+static int openCounter(pid_t pid, uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+/// One run of argv. Fills sample[] and returns 0, or the exit status of a
+/// failed run. Counters that cannot be opened are NAN.
+static int runOnce(char **argv, double sample[METRICS]) {
+    int go[2];
+    if (pipe(go)) return -1;
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        // Wait until the counters are attached, they start at exec.
+        char c;
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1) _exit(127);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(go[0]);
+    int fd[METRICS];
+    fd[WALL] = -1;
+    fd[INSTRUCTIONS] = openCounter(pid, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    fd[CYCLES] = openCounter(pid, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    fd[LOADS] = openCounter(pid, PERF_TYPE_HW_CACHE,
+                            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16));
+    fd[ICACHE_MISSES] = openCounter(pid, PERF_TYPE_HW_CACHE,
+                                    PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (write(go[1], "x", 1) != 1) return -1;
+    close(go[1]);
+    int status;
+    waitpid(pid, &status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    sample[WALL] = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    for (int m = INSTRUCTIONS; m < METRICS; ++m) {
+        uint64_t count;
+        sample[m] = NAN;
+        if (fd[m] < 0) continue;
+        if (read(fd[m], &count, sizeof(count)) == sizeof(count)) sample[m] = (double)count;
+        close(fd[m]);
+    }
+    if (!WIFEXITED(status)) return -1;
+    return WEXITSTATUS(status);
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/// Median of the n sorted values, and the order statistics that bound a
+/// distribution-free 95% confidence interval for it.
+static void printSummary(const char *name, double *values, int n) {
+    printf("  \"%s\": ", name);
+    if (isnan(values[0])) {
+        printf("null");
+        return;
+    }
+    qsort(values, n, sizeof(double), compare);
+    double median = n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+    int lo = (int)floor(n / 2.0 - 1.96 * sqrt(n) / 2);
+    int hi = (int)ceil(1 + n / 2.0 + 1.96 * sqrt(n) / 2) - 1;
+    if (lo < 0) lo = 0;
+    if (hi > n - 1) hi = n - 1;
+    printf("{\"median\": %.9g, \"ci95\": [%.9g, %.9g], \"min\": %.9g, \"max\": %.9g}", median, values[lo], values[hi],
+           values[0], values[n - 1]);
+}
+
+int main(int argc, char **argv) {
+    int runs = 10, warmups = 1, opt;
+    while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+        if (opt == 'n') runs = atoi(optarg);
+        else if (opt == 'w') warmups = atoi(optarg);
+        else break;
+    }
+    if (optind >= argc || runs < 1 || warmups < 0) {
+        fprintf(stderr, "usage: %s [-n runs] [-w warmups] -- program [args...]\n", argv[0]);
+        return 2;
+    }
+    char **program = argv + optind;
+
+    double sample[METRICS];
+    for (int i = 0; i < warmups; ++i)
+        if (runOnce(program, sample)) {
+            fprintf(stderr, "%s failed\n", program[0]);
+            return 1;
+        }
+    double *values[METRICS];
+    for (int m = 0; m < METRICS; ++m) values[m] = malloc(runs * sizeof(double));
+    for (int i = 0; i < runs; ++i) {
+        if (runOnce(program, sample)) {
+            fprintf(stderr, "%s failed\n", program[0]);
+            return 1;
+        }
+        for (int m = 0; m < METRICS; ++m) values[m][i] = sample[m];
+    }
+
+    printf("{\n  \"runs\": %d,\n  \"warmups\": %d,\n", runs, warmups);
+    for (int m = 0; m < METRICS; ++m) {
+        printSummary(names[m], values[m], runs);
+        printf(m + 1 < METRICS ? ",\n" : "\n");
+    }
+    printf("}\n");
+    return 0;
+}
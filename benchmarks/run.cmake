@@ -0,0 +1,16 @@
+# Runs PROGRAM with its output going to OUTPUT, for the benchmark build graph.
+# With PROFILE the raw profile is written there. With EXPECTED it fails
+# unless the output matches that file.
+if(PROFILE)
+  set(ENV{LLVM_PROFILE_FILE} ${PROFILE})
+endif()
+execute_process(COMMAND ${PROGRAM} OUTPUT_FILE ${OUTPUT} RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "${PROGRAM} failed: ${result}")
+endif()
+if(EXPECTED)
+  execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${EXPECTED} ${OUTPUT} RESULT_VARIABLE differ)
+  if(differ)
+    message(FATAL_ERROR "${PROGRAM} does not print what the unoptimized program does, see ${OUTPUT}")
+  endif()
+endif()
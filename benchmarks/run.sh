@@ -1,15 +1,16 @@
 PATH2LIB=~/eecs583/hw2/cmake-build-debug/HW2/LLVMHW2.so        # Specify your build directory in the project
-PASS=-fplicm-performance                   # Choose either -fplicm-correctness or -fplicm-performance
+PASS=fplicm-performance                    # Choose either fplicm-correctness or fplicm-performance
+HERE=$(cd "$(dirname "$0")" && pwd)
 
 # Delete outputs from previous run.
-rm -f default.profraw ${1}_prof ${1}_fplicm ${1}_no_fplicm *.bc ${1}.profdata *_output *.ll
+rm -f default.profraw ${1}_prof ${1}_vprof ${1}_fplicm ${1}_no_fplicm *.bc ${1}.profdata ${1}.valprof *_output *.ll
 
 # Convert source code to bitcode (IR)
 clang -emit-llvm -c ${1}.c -o ${1}.bc
 # Canonicalize natural loops
-opt -enable-new-pm=0 -loop-simplify ${1}.bc -o ${1}.ls.bc
+opt -passes=loop-simplify ${1}.bc -o ${1}.ls.bc
 # Instrument profiler
-opt -enable-new-pm=0 -pgo-instr-gen -instrprof ${1}.ls.bc -o ${1}.ls.prof.bc
+opt -passes=pgo-instr-gen,instrprof ${1}.ls.bc -o ${1}.ls.prof.bc
 # Generate binary executable with profiler embedded
 clang -fprofile-instr-generate ${1}.ls.prof.bc -o ${1}_prof
 
@@ -17,8 +18,22 @@ clang -fprofile-instr-generate ${1}.ls.prof.bc -o ${1}_prof
 ./${1}_prof > correct_output
 llvm-profdata merge -o ${1}.profdata default.profraw
 
+# Value profile: the dominant value of each loop load and how stable it is.
+# Only the performance pass uses it, so only then is it worth a run of the
+# instrumented program.
+USE=pgo-instr-use
+VALUE_PROFILE=
+case ${PASS} in *fplicm-performance*)
+    opt -load-pass-plugin ${PATH2LIB} -passes=fplicm-value-prof-gen ${1}.ls.bc -o ${1}.ls.vprof.bc
+    clang ${1}.ls.vprof.bc "$HERE"/valueprof.c -o ${1}_vprof
+    FPLICM_VALUE_PROFILE=${1}.valprof ./${1}_vprof > /dev/null
+    USE=${USE},fplicm-value-prof-use
+    VALUE_PROFILE=-fplicm-value-profile=${1}.valprof
+esac
+
 # Apply FPLICM
-opt -enable-new-pm=0 -o ${1}.fplicm.bc -pgo-instr-use -pgo-test-profile-file=${1}.profdata -load ${PATH2LIB} ${PASS} < ${1}.ls.bc > /dev/null
+opt -o ${1}.fplicm.bc -pgo-test-profile-file=${1}.profdata -load ${PATH2LIB} -load-pass-plugin ${PATH2LIB} \
+    ${VALUE_PROFILE} -passes=${USE},${PASS} < ${1}.ls.bc > /dev/null
 
 # Generate binary excutable before FPLICM: Unoptimzied code
 clang ${1}.ls.bc -o ${1}_no_fplicm
@@ -43,4 +58,4 @@ else
 fi
 
 # Cleanup
-#rm -f default.profraw ${1}_prof ${1}_fplicm ${1}_no_fplicm *.bc ${1}.profdata *_output *.ll
+#rm -f default.profraw ${1}_prof ${1}_vprof ${1}_fplicm ${1}_no_fplicm *.bc ${1}.profdata ${1}.valprof *_output *.ll
@@ -0,0 +1,49 @@
+PATH2LIB=~/eecs583/hw2/cmake-build-debug/HW2/LLVMHW2.so        # Specify your build directory in the project
+PASS=fplicm-performance                    # Choose either fplicm-correctness or fplicm-performance
+# Like run.sh, without the instrumented build: FPLICM reads a sample profile,
+# or with `static` as second argument no profile at all.
+# Usage: ../run_sample.sh <benchmark> [static]
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+# Delete outputs from previous run.
+rm -f ${1}_sample ${1}_fplicm ${1}_no_fplicm *.bc ${1}.prof *_output *.ll
+
+if [ "$2" == "static" ]; then
+    # Branch probabilities come from the static heuristics
+    clang -emit-llvm -c ${1}.c -o ${1}.bc
+    PROFILE=
+else
+    # Sample the program, then compile with line tables the profile refers to
+    "$HERE"/sample.sh ${1} ${1}.prof || exit 1
+    clang -g -gline-tables-only -fprofile-sample-use=${1}.prof -emit-llvm -c ${1}.c -o ${1}.bc
+    PROFILE="-sample-profile-file=${1}.prof"
+    PASS=sample-profile,${PASS}
+fi
+# Canonicalize natural loops
+opt -passes=loop-simplify ${1}.bc -o ${1}.ls.bc
+
+# Generate binary excutable before FPLICM: Unoptimzied code
+clang ${1}.ls.bc -o ${1}_no_fplicm
+./${1}_no_fplicm > correct_output
+
+# Apply FPLICM
+opt -o ${1}.fplicm.bc ${PROFILE} -load-pass-plugin ${PATH2LIB} -passes=${PASS} < ${1}.ls.bc > /dev/null
+# Generate binary executable after FPLICM: Optimized code
+clang ${1}.fplicm.bc -o ${1}_fplicm
+
+# Produce output from binary to check correctness
+./${1}_fplicm > fplicm_output
+
+echo -e "\n=== Correctness Check ==="
+if [ "$(diff correct_output fplicm_output)" != "" ]; then
+    echo -e ">> FAIL\n"
+else
+    echo -e ">> PASS\n"
+    # Measure performance
+    echo -e "1. Performance of unoptimized code"
+    time ./${1}_no_fplicm > /dev/null
+    echo -e "\n\n"
+    echo -e "2. Performance of optimized code"
+    time ./${1}_fplicm > /dev/null
+    echo -e "\n\n"
+fi
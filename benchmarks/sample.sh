@@ -0,0 +1,41 @@
+#!/bin/bash
+# Writes a sample profile of ${1}.c to ${2:-${1}.prof}, in the text format of
+# -fprofile-sample-use and opt -sample-profile-file.
+# With perf and create_llvm_prof (AutoFDO) on the PATH it is recorded from a
+# -g build of the program. Otherwise a stand-in for `perf record` writes the
+# line counts of a gcov build in the same format: one record per function,
+# `name:total:entries`, then `line offset: count` for each line of its body.
+OUT=${2:-${1}.prof}
+
+if command -v perf > /dev/null && command -v create_llvm_prof > /dev/null; then
+    clang -g -gline-tables-only ${1}.c -o ${1}_sample &&
+    perf record -b -o ${1}.perf.data ./${1}_sample > /dev/null &&
+    exec create_llvm_prof --binary=${1}_sample --profile=${1}.perf.data --out=$OUT
+    exit 1
+fi
+
+gcc -O0 --coverage -c ${1}.c -o ${1}.o && gcc --coverage ${1}.o -o ${1}_sample || exit 1
+rm -f ${1}.gcda
+./${1}_sample > /dev/null || exit 1
+# Offsets count from the line of the function's name, the first line gcov
+# gives after "function <name> called <n>".
+gcov -b -t ${1}.c 2> /dev/null | awk -F: '
+    /^function / {
+        split($0, w, " ")
+        fn = w[2]; head[fn] = w[4]; start = 0; order[++n] = fn
+        next
+    }
+    NF >= 3 && fn != "" {
+        count = $1; gsub(/[ *]/, "", count)
+        if (count == "-") next
+        if (count ~ /^[#=]+$/) count = 0
+        if (!start) start = $2
+        body[fn] = body[fn] sprintf(" %d: %.0f\n", $2 - start, count)
+        total[fn] += count
+    }
+    END {
+        for (i = 1; i <= n; ++i)
+            printf "%s:%.0f:%.0f\n%s", order[i], total[order[i]], head[order[i]], body[order[i]]
+    }' > $OUT
+rm -f ${1}.o ${1}.gcno ${1}.gcda
+[ -s $OUT ]
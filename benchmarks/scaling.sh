@@ -0,0 +1,41 @@
+#!/bin/bash
+# Compile-time scaling of the FPLICM passes on a synthetic loop whose body
+# holds N cold-write / hot-read units, i.e. roughly 3*N basic blocks.
+# Usage: ./scaling.sh [N...]      (default: 250 500 1000 2000 4000)
+PATH2LIB=~/eecs583/hw2/cmake-build-debug/HW2/LLVMHW2.so        # Specify your build directory in the project
+SIZES=${@:-250 500 1000 2000 4000}
+
+gen() {
+    echo "#include <stdio.h>"
+    echo "int a[$1];"
+    echo "int main() {"
+    echo "    long s = 0;"
+    echo "    for (int i = 0; i < 100000; i++) {"
+    for ((k = 0; k < $1; k++)); do
+        echo "        if (__builtin_expect(i % 9973 == $k, 0)) a[$k] = i;"
+        echo "        s += a[$k];"
+    done
+    echo "    }"
+    echo "    printf(\"%ld\\n\", s);"
+    echo "    return 0;"
+    echo "}"
+}
+
+printf "%8s %8s %14s %14s\n" N blocks correctness performance
+for n in ${SIZES}; do
+    gen $n > scale_$n.c
+    clang -emit-llvm -c scale_$n.c -o scale_$n.bc
+    # Branch weights come from __builtin_expect, so no profiling run is needed
+    opt -passes=lower-expect,loop-simplify scale_$n.bc -o scale_$n.ls.bc
+    blocks=$(llvm-dis scale_$n.ls.bc -o - | grep -cE '^[0-9a-z._]+:')
+    printf "%8d %8d" $n $blocks
+    for PASS in fplicm-correctness fplicm-performance; do
+        # Wall clock seconds of the whole opt run
+        secs=$( { TIMEFORMAT=%R; time opt -load-pass-plugin ${PATH2LIB} -passes=${PASS} scale_$n.ls.bc -o /dev/null 2>/dev/null; } 2>&1 )
+        printf " %14s" $secs
+    done
+    echo
+done
+
+# Cleanup
+rm -f scale_*.c scale_*.bc
@@ -0,0 +1,127 @@
+#!/bin/bash
+# Threshold tuner: sweeps the frequent path threshold of every loop the pass
+# visits, one loop at a time with the others at -fplicm-threshold, and keeps
+# the value with the lowest median runtime. Results go to a JSON file, with
+# the -fplicm-loop-threshold option that applies them.
+# Usage: ./tune.sh [-n runs] [-t "thresholds"] [-o out.json] [benchmark...]
+#        (default: 5 runs, 0.6 to 0.95 in steps of 0.05, tune.json, every benchmark)
+# Set PATH2LIB to the plugin and PASS to the pass to tune.
+HERE=$(cd "$(dirname "$0")" && pwd)
+PATH2LIB=${PATH2LIB:-$HERE/../build/HW2/LLVMHW2.so}
+PASS=${PASS:-fplicm-performance}
+CC=${CC:-clang}
+WORK=${WORK:-${TMPDIR:-/tmp}/fplicm-tune}
+
+RUNS=5
+THRESHOLDS="0.6 0.65 0.7 0.75 0.8 0.85 0.9 0.95"
+OUT=tune.json
+while getopts "n:t:o:" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        t) THRESHOLDS=$OPTARG ;;
+        o) OUT=$OPTARG ;;
+        *) exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+BENCHMARKS=${@:-$(cd "$HERE" && ls correctness/*.c performance/*.c 2>/dev/null | sed 's/\.c$//')}
+
+[ -f "$PATH2LIB" ] || { echo "No plugin at $PATH2LIB, set PATH2LIB" >&2; exit 1; }
+mkdir -p "$WORK"
+cc -O2 -o "$WORK/perfrun" "$HERE/perfrun.c" -lm || exit 1
+
+# Profile the loop-simplified code once, as run.sh does.
+prepare() {
+    local src=$1 name=$2
+    $CC -emit-llvm -c "$src" -o $name.bc &&
+    opt -passes=loop-simplify $name.bc -o $name.ls.bc &&
+    opt -passes=pgo-instr-gen,instrprof $name.ls.bc -o $name.ls.prof.bc &&
+    $CC -fprofile-instr-generate $name.ls.prof.bc -o ${name}_prof &&
+    LLVM_PROFILE_FILE=$name.profraw ./${name}_prof > ${name}_correct_output &&
+    llvm-profdata merge -o $name.profdata $name.profraw
+}
+
+# fplicm <name> <out.bc> [opt args...]
+fplicm() {
+    local name=$1 out=$2
+    shift 2
+    opt -load "$PATH2LIB" -load-pass-plugin "$PATH2LIB" -pgo-test-profile-file=$name.profdata \
+        -passes=pgo-instr-use,$PASS "$@" $name.ls.bc -o $out
+}
+
+# Median runtime of the program FPLICM makes with the given options, or
+# "null" if it prints something else. Thresholds that give the same code
+# share one measurement.
+declare -A measured
+measure() {
+    local name=$1
+    shift
+    fplicm $name $name.t.bc "$@" || { echo null; return; }
+    local key=$(md5sum < $name.t.bc | cut -d' ' -f1)
+    if [ -z "${measured[$key]}" ]; then
+        if $CC $name.t.bc -o ${name}_t && ./${name}_t | cmp -s - ${name}_correct_output; then
+            measured[$key]=$(./perfrun -n $RUNS -w 1 -- ./${name}_t | grep -o '"median": [^,]*' | head -1 | cut -d' ' -f2)
+        fi
+        measured[$key]=${measured[$key]:-null}
+    fi
+    echo ${measured[$key]}
+}
+
+commit=$(git -C "$HERE" rev-parse HEAD 2>/dev/null)
+{
+    echo "{"
+    echo "  \"commit\": \"$commit\","
+    echo "  \"pass\": \"$PASS\","
+    echo "  \"thresholds\": [$(echo $THRESHOLDS | sed 's/ /, /g')],"
+    echo "  \"benchmarks\": {"
+} > "$OUT"
+
+first=1
+cd "$WORK" || exit 1
+for bench in $BENCHMARKS; do
+    name=$(basename $bench)
+    prepare "$HERE/$bench.c" $name > $name.log 2>&1 || { echo "$name: build failed, see $WORK/$name.log"; continue; }
+    measured=()
+    loops=$(fplicm $name /dev/null -pass-remarks-analysis=fplicm 2>&1 |
+            sed -n 's/.*loop \([^ ]*\): frequent path threshold.*/\1/p' | sort -u)
+    default=$(measure $name)
+    echo "$name: ${default}s at -fplicm-threshold"
+
+    option=
+    json=
+    for loop in $loops; do
+        best=
+        best_time=$default
+        sweep=
+        for t in $THRESHOLDS; do
+            time=$(measure $name -fplicm-loop-threshold=$loop=$t)
+            sweep="$sweep${sweep:+, }\"$t\": $time"
+            [ $time != null ] || continue
+            if [ $best_time == null ] || awk -v a=$time -v b=$best_time 'BEGIN { exit !(a < b) }'; then
+                best=$t
+                best_time=$time
+            fi
+        done
+        printf "  %-12s best %-6s %ss\n" $loop ${best:-default} $best_time
+        [ -z "$best" ] || option="$option${option:+,}$loop=$best"
+        json="$json${json:+,
+}        \"$loop\": {\"best\": ${best:-null}, \"median_s\": $best_time, \"sweep\": {$sweep}}"
+    done
+    [ -z "$option" ] || echo "  -fplicm-loop-threshold=$option"
+
+    [ $first = 1 ] || echo "    ," >> "$OUT"
+    first=0
+    {
+        echo "    \"$name\": {"
+        echo "      \"default_s\": $default,"
+        echo "      \"option\": \"${option:+-fplicm-loop-threshold=$option}\","
+        echo "      \"loops\": {"
+        [ -z "$json" ] || echo "$json"
+        echo "      }"
+        echo "    }"
+    } >> "$OUT"
+done
+cd - > /dev/null
+echo "  }" >> "$OUT"
+echo "}" >> "$OUT"
+echo "Results written to $OUT"
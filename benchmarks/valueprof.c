@@ -0,0 +1,71 @@
+// Runtime of the value profile: linked into programs instrumented with
+// -passes=fplicm-value-prof-gen. Each loop load reports every value it reads.
+// At exit, one line per load goes to $FPLICM_VALUE_PROFILE (default
+// default.valprof):
+//   function load loads value hits total changes
+// where load numbers the loop loads of the function, loads is how many it
+// has, value is the dominant value by majority vote, hits how often it was
+// read since it became the candidate (a lower bound of its count), total how
+// often the load ran and changes how often it read a value other than the
+// one before.
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Same layout as the table the pass emits.
+struct site {
+    const char *function;
+    int64_t index, sites;
+    int64_t value, votes, hits, total, changes, last;
+};
+
+struct table {
+    struct site *sites;
+    int64_t n;
+    struct table *next;
+};
+
+static struct table *tables;
+
+void __fplicm_value_prof(struct site *s, int64_t v) {
+    if (s->total && v != s->last) s->changes++;
+    s->last = v;
+    s->total++;
+    if (!s->votes) {
+        s->value = v;
+        s->votes = s->hits = 1;
+    } else if (v == s->value) {
+        s->votes++;
+        s->hits++;
+    } else {
+        s->votes--;
+    }
+}
+
+static void dump(void) {
+    const char *path = getenv("FPLICM_VALUE_PROFILE");
+    FILE *out = fopen(path ? path : "default.valprof", "w");
+    if (!out) {
+        perror("fplicm value profile");
+        return;
+    }
+    for (struct table *t = tables; t; t = t->next)
+        for (int64_t i = 0; i < t->n; ++i) {
+            struct site *s = &t->sites[i];
+            fprintf(out, "%s %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 "\n", s->function,
+                    s->index, s->sites, s->value, s->hits, s->total, s->changes);
+        }
+    fclose(out);
+}
+
+// Called by a constructor of every instrumented module.
+void __fplicm_value_prof_init(struct site *sites, int64_t n) {
+    struct table *t = malloc(sizeof(*t));
+    if (!t) return;
+    if (!tables) atexit(dump);
+    t->sites = sites;
+    t->n = n;
+    t->next = tables;
+    tables = t;
+}
@@ -0,0 +1,64 @@
+; The correctness pass with calls on the frequent path. @peek is
+; readonly, and @touch is argmemonly and passed @h, so neither can write
+; @g and its load is hoisted. @touch may write @h, so the load of @h
+; stays in the loop.
+; PASSES: fplicm-correctness,verify
+; CHECK: entry:
+; CHECK-NEXT: %a = load i64, i64* @g
+; CHECK-NOT: load i64, i64* @h
+; CHECK: loop:
+; CHECK: %b = load i64, i64* @h
+; CHECK: call i64 @peek()
+; CHECK: call void @touch(i64* @h)
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 1000
+@h = global i64 7
+@k = global i64 0
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i64 @peek() readonly {
+  %v = load i64, i64* @k
+  ret i64 %v
+}
+
+define void @touch(i64* %p) argmemonly {
+  %v = load i64, i64* %p
+  %w = add i64 %v, 1
+  store i64 %w, i64* %p
+  ret void
+}
+
+define i32 @main() !prof !0 {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %join ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %join ]
+  %a = load i64, i64* @g
+  %b = load i64, i64* @h
+  %x = add i64 %a, %b
+  %k = call i64 @peek()
+  %y = add i64 %x, %k
+  call void @touch(i64* @h)
+  %snext = add i64 %s, %y
+  %r = urem i64 %i, 97
+  %rare = icmp eq i64 %r, 0
+  br i1 %rare, label %cold, label %join, !prof !1
+cold:
+  %gi = add i64 %a, %i
+  store i64 %gi, i64* @g
+  %hi = add i64 %b, 1
+  store i64 %hi, i64* @h
+  br label %join
+join:
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !2
+end:
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %snext)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 11, i32 989}
+!2 = !{!"branch_weights", i32 999, i32 1}
@@ -0,0 +1,54 @@
+; Divisions by a value only a cold store changes, on a frequent path
+; block the loop may skip, are hoisted behind a guard on the divisor. The
+; constant dividend of %q is not frozen and cannot be the smallest i64,
+; so only %m gets the -1 check.
+; CHECK: entry:
+; CHECK-NOT: freeze i64 1000
+; CHECK: %guard.d = freeze i64 %b
+; CHECK-NEXT: %guard.z = icmp eq i64 %guard.d, 0
+; CHECK-NEXT: %guard.safe = select i1 %guard.z, i64 1, i64 %guard.d
+; CHECK-NEXT: %q = sdiv i64 1000, %guard.safe
+; CHECK: %guard.x = freeze i64 %a
+; CHECK: %guard.min = icmp eq i64 %guard.x, -9223372036854775808
+; CHECK: %m = srem i64 %guard.x,
+; CHECK: loop:
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 1000
+@h = global i64 7
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i32 @main() !prof !0 {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %join ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %join ]
+  %a = load i64, i64* @g
+  %b = load i64, i64* @h
+  %r = urem i64 %i, 97
+  %rare = icmp eq i64 %r, 0
+  br i1 %rare, label %cold, label %div, !prof !1
+cold:
+  %hi = add i64 %r, 3
+  %hj = add i64 %hi, %i
+  store i64 %hj, i64* @h
+  br label %join
+div:
+  %q = sdiv i64 1000, %b
+  %m = srem i64 %a, %b
+  %x = add i64 %q, %m
+  br label %join
+join:
+  %y = phi i64 [ 0, %cold ], [ %x, %div ]
+  %snext = add i64 %s, %y
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !2
+end:
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %snext)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 11, i32 989}
+!2 = !{!"branch_weights", i32 999, i32 1}
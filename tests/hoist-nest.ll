@@ -0,0 +1,56 @@
+; The inner loop reads @g and only its cold block writes it; the outer
+; loop leaves @g alone on its frequent path. The load goes out of both
+; loops, and the fix-up after the cold store carries into the outer loop.
+; CHECK: entry:
+; CHECK-NEXT: %a = load i64, i64* @g
+; CHECK: outer:
+; CHECK-NEXT: phi i64 [ %fix.lcssa, %latch ], [ %a, %entry ]
+; CHECK-NOT: load i64, i64* @g
+; CHECK: cold:
+; CHECK: store i64 %gi, i64* @g
+; CHECK-NEXT: load i64, i64* @g
+; CHECK-NOT: load i64, i64* @g
+; CHECK: latch:
+; CHECK-NEXT: %fix.lcssa = phi i64 [ %fix, %join ]
+; CHECK: ret i32 0
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 1000
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i32 @main() !prof !0 {
+entry:
+  br label %outer
+outer:
+  %j = phi i64 [ 0, %entry ], [ %jnext, %latch ]
+  %t = phi i64 [ 0, %entry ], [ %snext, %latch ]
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %outer ], [ %inext, %join ]
+  %s = phi i64 [ %t, %outer ], [ %snext, %join ]
+  %a = load i64, i64* @g
+  %x = add i64 %a, %i
+  %snext = add i64 %s, %x
+  %k = add i64 %i, %j
+  %r = urem i64 %k, 97
+  %rare = icmp eq i64 %r, 0
+  br i1 %rare, label %cold, label %join, !prof !1
+cold:
+  %gi = add i64 %a, %j
+  store i64 %gi, i64* @g
+  br label %join
+join:
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 100
+  br i1 %c, label %loop, label %latch, !prof !2
+latch:
+  %jnext = add i64 %j, 1
+  %d = icmp ult i64 %jnext, 100
+  br i1 %d, label %outer, label %end, !prof !2
+end:
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %snext)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 11, i32 989}
+!2 = !{!"branch_weights", i32 99, i32 1}
@@ -0,0 +1,45 @@
+; Block placement after loop versioning: the alias check is weighted, so
+; llc lays out the fast loop as its fall-through and moves the original
+; loop out of the way. Unweighted, the original loop would come first.
+; OPTIONS: -fplicm-versioning
+; CHECK: br i1 %fplicm.overlap, label %loop.ph.fplicm.orig, label %loop.ph, !prof
+; LLC: -O2
+; ASM-LABEL: sum:
+; ASM: # %loop.fplicm.check
+; ASM-NOT: # %loop.ph.fplicm.orig
+; ASM: # %loop.ph{{$}}
+; ASM-NEXT: movq
+; ASM-NOT: # %loop.ph.fplicm.orig
+; ASM: # %loop{{$}}
+; ASM: # %loop.ph.fplicm.orig
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 3
+@h = global i64 0
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i64 @sum(i64* %p, i64* %q) !prof !0 {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %loop ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %loop ]
+  %a = load i64, i64* %p
+  %x = add i64 %a, %i
+  %snext = add i64 %s, %x
+  store i64 %x, i64* %q
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !1
+end:
+  ret i64 %snext
+}
+
+define i32 @main() !prof !0 {
+entry:
+  %s = call i64 @sum(i64* @g, i64* @h)
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %s)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 999, i32 1}
@@ -0,0 +1,69 @@
+; The loop of multi-latch.ll through the correctness pass. Its latches
+; make loop-simplify split it into a nest, so the outer loop's load has an
+; LCSSA phi of the inner loop as its user. The reload goes where the load
+; was, and the cold store to @g stays next to its fix-up, since the second
+; call of @sum reads @g again.
+; PASSES: fplicm-correctness,verify
+; CHECK: loop.preheader:
+; CHECK: %a = load i64, i64* @g
+; CHECK: store i64 %a, i64* %var
+; CHECK: loop:
+; CHECK: %fix = load i64, i64* %var
+; CHECK: body:
+; CHECK: %a.lcssa = phi i64 [ %fix, %loop ]
+; CHECK: cold:
+; CHECK: store i64 %gi, i64* %var
+; CHECK-NEXT: store i64 %gi, i64* @g
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 1000
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i64 @sum(i64 %n) !prof !0 {
+entry:
+  %odd = and i64 %n, 1
+  %isodd = icmp ne i64 %odd, 0
+  br i1 %isodd, label %loop, label %even
+even:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ 1, %even ], [ %inext, %skip ], [ %inext, %join ]
+  %s = phi i64 [ 0, %entry ], [ 0, %even ], [ %s, %skip ], [ %snext, %join ]
+  %a = load i64, i64* @g
+  %inext = add i64 %i, 1
+  %m = urem i64 %i, 5
+  %five = icmp eq i64 %m, 0
+  br i1 %five, label %skip, label %body, !prof !1
+skip:
+  %c1 = icmp ult i64 %inext, %n
+  br i1 %c1, label %loop, label %end, !prof !2
+body:
+  %x = add i64 %a, %i
+  %r = urem i64 %i, 97
+  %rare = icmp eq i64 %r, 1
+  br i1 %rare, label %cold, label %join, !prof !3
+cold:
+  %gi = add i64 %a, 3
+  store i64 %gi, i64* @g
+  br label %join
+join:
+  %snext = add i64 %s, %x
+  %c2 = icmp ult i64 %inext, %n
+  br i1 %c2, label %loop, label %end, !prof !2
+end:
+  %res = phi i64 [ %s, %skip ], [ %snext, %join ]
+  ret i64 %res
+}
+
+define i32 @main() {
+entry:
+  %a = call i64 @sum(i64 1000)
+  %b = call i64 @sum(i64 999)
+  %s = add i64 %a, %b
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %s)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 2}
+!1 = !{!"branch_weights", i32 200, i32 800}
+!2 = !{!"branch_weights", i32 999, i32 1}
+!3 = !{!"branch_weights", i32 11, i32 989}
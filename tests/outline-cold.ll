@@ -0,0 +1,52 @@
+; After FPLICM, fplicm-outline moves the cold region into a cold,
+; noinline function in .text.unlikely: the store, a rare printf and the
+; fix-up block after them. The loop keeps the frequent path and a call.
+; PASSES: fplicm-performance,fplicm-outline,verify
+; CHECK-LABEL: define i32 @main(
+; CHECK: %a = load i64, i64* @g
+; CHECK: loop:
+; CHECK-NOT: @printf
+; CHECK: call void @main.cold(
+; CHECK-NOT: @printf
+; CHECK: join:
+; CHECK: define internal void @main.cold({{.*}}) #[[ATTR:[0-9]+]] {{.*}}!section_prefix ![[PREFIX:[0-9]+]]
+; CHECK: store i64 %gj, i64* @g
+; CHECK-NEXT: call i32 (i8*, ...) @printf
+; CHECK: join.fplicm.fixup:
+; CHECK-NEXT: load i64, i64* @g
+; CHECK: attributes #[[ATTR]] = { cold noinline }
+; CHECK: ![[PREFIX]] = !{!"function_section_prefix", !"unlikely"}
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 1000
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i32 @main() !prof !0 {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %join ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %join ]
+  %a = load i64, i64* @g
+  %x = add i64 %a, %i
+  %snext = add i64 %s, %x
+  %r = urem i64 %i, 97
+  %rare = icmp eq i64 %r, 0
+  br i1 %rare, label %cold, label %join, !prof !1
+cold:
+  %gi = mul i64 %i, 3
+  %gj = add i64 %gi, %a
+  store i64 %gj, i64* @g
+  %q = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %gj)
+  br label %join
+join:
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !2
+end:
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %snext)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 11, i32 989}
+!2 = !{!"branch_weights", i32 999, i32 1}
@@ -0,0 +1,41 @@
+; The cold path runs in the first three iterations only. fplicm-peel, run
+; at module level after FPLICM, peels them off, and the steady-state loop
+; keeps neither the branch nor the cold block.
+; PASSES: fplicm-performance,fplicm-peel,verify
+; CHECK: loop.peel:
+; CHECK: loop:
+; CHECK-NOT: br i1 %first
+; CHECK-NOT: {{^}}cold:
+; CHECK: end:
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 1000
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i32 @main() !prof !0 {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %join ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %join ]
+  %a = load i64, i64* @g
+  %first = icmp ult i64 %i, 3
+  br i1 %first, label %cold, label %join, !prof !1
+cold:
+  %gi = add i64 %a, %i
+  store i64 %gi, i64* @g
+  br label %join
+join:
+  %b = load i64, i64* @g
+  %x = add i64 %b, %i
+  %snext = add i64 %s, %x
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !2
+end:
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %snext)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 3, i32 997}
+!2 = !{!"branch_weights", i32 999, i32 1}
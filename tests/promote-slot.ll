@@ -0,0 +1,43 @@
+; A stack slot the loop reads on its frequent path and writes on its
+; infrequent one, as -O0 code keeps a local, is promoted: one load before
+; the loop, SSA values inside it and a store at the exit.
+; CHECK: %t.promoted = load i64, i64* %t
+; CHECK: loop:
+; CHECK-NOT: {{load|store}} i64{{.*}} %t{{$|,}}
+; CHECK: end:
+; CHECK: store i64 %{{.*}}, i64* %t
+; CHECK-NEXT: %last = load i64, i64* %t
+target triple = "x86_64-unknown-linux-gnu"
+@fmt = private constant [9 x i8] c"%ld %ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i32 @main() !prof !0 {
+entry:
+  %t = alloca i64
+  store i64 7, i64* %t
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %join ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %join ]
+  %a = load i64, i64* %t
+  %x = add i64 %a, %i
+  %snext = add i64 %s, %x
+  %r = urem i64 %i, 97
+  %rare = icmp eq i64 %r, 0
+  br i1 %rare, label %cold, label %join, !prof !1
+cold:
+  %ai = add i64 %a, 1
+  store i64 %ai, i64* %t
+  br label %join
+join:
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !2
+end:
+  %last = load i64, i64* %t
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([9 x i8], [9 x i8]* @fmt, i64 0, i64 0), i64 %snext, i64 %last)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 11, i32 989}
+!2 = !{!"branch_weights", i32 999, i32 1}
@@ -0,0 +1,45 @@
+; Loads of @g and @h that only cold stores clobber, under
+; -fplicm-registers=6. The pass estimates that the loop needs five
+; registers of its own, so only the first load, of @g, fits in
+; the sixth. The load of @h stays in the loop.
+; OPTIONS: -fplicm-registers=6
+; CHECK: entry:
+; CHECK-NEXT: %a = load i64, i64* @g
+; CHECK: loop:
+; CHECK: %b = load i64, i64* @h
+; CHECK: cold:
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 1000
+@h = global i64 7
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i32 @main() !prof !0 {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %join ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %join ]
+  %a = load i64, i64* @g
+  %b = load i64, i64* @h
+  %x = mul i64 %a, %i
+  %y = add i64 %x, %b
+  %snext = add i64 %s, %y
+  %r = urem i64 %i, 97
+  %rare = icmp eq i64 %r, 0
+  br i1 %rare, label %cold, label %join, !prof !1
+cold:
+  store i64 %i, i64* @g
+  store i64 %r, i64* @h
+  br label %join
+join:
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !2
+end:
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %snext)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 11, i32 989}
+!2 = !{!"branch_weights", i32 999, i32 1}
@@ -0,0 +1,49 @@
+# Runs INPUT with lli before and after opt -passes=PASSES, for the regression
+# tests. Fails unless both print the same. The optimized IR goes to
+# OUTPUT.ll. The PASSES, OPTIONS, CHECK and LLC comments of INPUT are
+# described in CMakeLists.txt.
+file(STRINGS ${INPUT} passes REGEX "^; PASSES: ")
+if(passes)
+  string(REGEX REPLACE ".*PASSES: " "" PASSES "${passes}")
+endif()
+file(STRINGS ${INPUT} options REGEX "^; OPTIONS: ")
+string(REGEX REPLACE ".*OPTIONS: " "" options "${options}")
+separate_arguments(options)
+
+execute_process(COMMAND ${LLI} ${INPUT} OUTPUT_VARIABLE expected RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "${INPUT} failed: ${result}")
+endif()
+# -load as well, so the plugin's options parse.
+execute_process(COMMAND ${OPT} -load ${PLUGIN} -load-pass-plugin ${PLUGIN} -passes=${PASSES} ${options}
+                        -S ${INPUT} -o ${OUTPUT}.ll
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "opt -passes=${PASSES} failed on ${INPUT}: ${result}")
+endif()
+execute_process(COMMAND ${LLI} ${OUTPUT}.ll OUTPUT_VARIABLE output RESULT_VARIABLE result)
+if(NOT result EQUAL 0 OR NOT output STREQUAL expected)
+  message(FATAL_ERROR "${OUTPUT}.ll prints ${output}instead of ${expected}")
+endif()
+
+file(STRINGS ${INPUT} checks REGEX "^; CHECK")
+if(checks)
+  execute_process(COMMAND ${FILECHECK} ${INPUT} INPUT_FILE ${OUTPUT}.ll RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${OUTPUT}.ll does not match the CHECK lines of ${INPUT}")
+  endif()
+endif()
+
+file(STRINGS ${INPUT} llc REGEX "^; LLC:")
+if(llc)
+  string(REGEX REPLACE ".*LLC:" "" llc "${llc}")
+  separate_arguments(llc)
+  execute_process(COMMAND ${LLC} ${llc} ${OUTPUT}.ll -o ${OUTPUT}.s RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "llc failed on ${OUTPUT}.ll: ${result}")
+  endif()
+  execute_process(COMMAND ${FILECHECK} --check-prefix=ASM ${INPUT} INPUT_FILE ${OUTPUT}.s RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${OUTPUT}.s does not match the ASM lines of ${INPUT}")
+  endif()
+endif()
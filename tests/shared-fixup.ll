@@ -0,0 +1,56 @@
+; A cold region with two blocks writes @g and @h. The loads of both and
+; their sum are hoisted. Instead of a copy after each store, the region
+; recomputes them once, in one fix-up block on its way back to the
+; frequent path.
+; CHECK: entry:
+; CHECK-NEXT: %a = load i64, i64* @g
+; CHECK-NEXT: %b = load i64, i64* @h
+; CHECK: cold:
+; CHECK-NOT: load
+; CHECK: more:
+; CHECK-NOT: load
+; CHECK: join.fplicm.fixup:
+; CHECK-NEXT: load i64, i64* @g
+; CHECK-NEXT: load i64, i64* @h
+; CHECK-NEXT: add i64
+; CHECK-NEXT: br label %join
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 1000
+@h = global i64 7
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i32 @main() !prof !0 {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %join ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %join ]
+  %a = load i64, i64* @g
+  %b = load i64, i64* @h
+  %x = add i64 %a, %b
+  %y = add i64 %x, %i
+  %snext = add i64 %s, %y
+  %r = urem i64 %i, 97
+  %rare = icmp eq i64 %r, 0
+  br i1 %rare, label %cold, label %join, !prof !1
+cold:
+  store i64 %i, i64* @g
+  %odd = and i64 %i, 1
+  %isodd = icmp ne i64 %odd, 0
+  br i1 %isodd, label %more, label %join
+more:
+  %hi = add i64 %b, 3
+  store i64 %hi, i64* @h
+  br label %join
+join:
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !2
+end:
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %snext)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 11, i32 989}
+!2 = !{!"branch_weights", i32 999, i32 1}
@@ -0,0 +1,37 @@
+; %m changes every iteration and only the cold block uses it, so it is
+; sunk there, out of the frequent path.
+; CHECK: loop:
+; CHECK-NOT: mul i64 %i, %i
+; CHECK: cold:
+; CHECK-NEXT: %m.sink = mul i64 %i, %i
+; CHECK: join:
+target triple = "x86_64-unknown-linux-gnu"
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i32 @main() !prof !0 {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %join ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %join ]
+  %m = mul i64 %i, %i
+  %r = urem i64 %i, 97
+  %rare = icmp eq i64 %r, 0
+  br i1 %rare, label %cold, label %join, !prof !1
+cold:
+  %sm = add i64 %s, %m
+  br label %join
+join:
+  %t = phi i64 [ %sm, %cold ], [ %s, %loop ]
+  %snext = add i64 %t, %i
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !2
+end:
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %snext)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 11, i32 989}
+!2 = !{!"branch_weights", i32 999, i32 1}
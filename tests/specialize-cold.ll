@@ -0,0 +1,40 @@
+; The same loop as specialize-no-cold.ll with a rare printf on an
+; infrequent path.
+; CHECK: loop.fplicm.recheck:
+; CHECK-NEXT: %a.current{{.*}} = load i64, i64* @g
+; CHECK: br i1 %fplicm.mismatch{{.*}}, label %loop.fplicm.bail, label %loop
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 5
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i32 @main() !prof !0 {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %join ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %join ]
+  %a = load i64, i64* @g, !fplicm.value !3
+  %d = mul i64 %a, 3
+  %x = add i64 %d, %i
+  %snext = add i64 %s, %x
+  %u = sdiv i64 %d, 3
+  store i64 %u, i64* @g
+  %r = urem i64 %i, 97
+  %rare = icmp eq i64 %r, 0
+  br i1 %rare, label %cold, label %join, !prof !1
+cold:
+  %q = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %s)
+  br label %join
+join:
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !2
+end:
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %snext)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 11, i32 989}
+!2 = !{!"branch_weights", i32 999, i32 1}
+!3 = !{i64 5, i64 1000, i64 1000}
@@ -0,0 +1,44 @@
+; The load of %p is only blocked by the frequent store to %q, and there is
+; no infrequent path. The loop is versioned on a runtime check that the two
+; do not overlap, and the fast version loads %p before the loop. @main
+; calls it with pointers that alias and pointers that do not.
+; OPTIONS: -fplicm-versioning
+; CHECK-LABEL: define i64 @sum(
+; CHECK: fplicm.overlap
+; CHECK: %a = load i64, i64* %p
+; CHECK: loop:
+; CHECK-NOT: load i64, i64* %p
+; CHECK: br i1 %c, label %loop
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 3
+@h = global i64 0
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i64 @sum(i64* %p, i64* %q) !prof !0 {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %loop ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %loop ]
+  %a = load i64, i64* %p
+  %x = add i64 %a, %i
+  %snext = add i64 %s, %x
+  store i64 %x, i64* %q
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !1
+end:
+  ret i64 %snext
+}
+
+define i32 @main() !prof !0 {
+entry:
+  %apart = call i64 @sum(i64* @g, i64* @h)
+  %p1 = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %apart)
+  %same = call i64 @sum(i64* @g, i64* @g)
+  %p2 = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %same)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 2}
+!1 = !{!"branch_weights", i32 999, i32 1}
@@ -0,0 +1,41 @@
+; A division of a value loaded before a cold store by one loaded after
+; another: no rewrite of its uses gives both loads the right value, so
+; the division stays in the loop. Each load is still hoisted on its own.
+target triple = "x86_64-unknown-linux-gnu"
+@g = global i64 1000
+@h = global i64 7
+@fmt = private constant [5 x i8] c"%ld\0A\00"
+declare i32 @printf(i8*, ...)
+
+define i32 @main() !prof !0 {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %inext, %join ]
+  %s = phi i64 [ 0, %entry ], [ %snext, %join ]
+  %a = load i64, i64* @g
+  %r = urem i64 %i, 97
+  %rare = icmp eq i64 %r, 0
+  br i1 %rare, label %cold, label %join, !prof !1
+cold:
+  %gi = mul i64 %i, 1000
+  store i64 %gi, i64* @g
+  %hi = add i64 %r, 3
+  %hj = add i64 %hi, %i
+  store i64 %hj, i64* @h
+  br label %join
+join:
+  %b = load i64, i64* @h
+  %q = sdiv i64 %a, %b
+  %x = add i64 %q, %a
+  %snext = add i64 %s, %x
+  %inext = add i64 %i, 1
+  %c = icmp ult i64 %inext, 1000
+  br i1 %c, label %loop, label %end, !prof !2
+end:
+  %p = call i32 (i8*, ...) @printf(i8* getelementptr ([5 x i8], [5 x i8]* @fmt, i64 0, i64 0), i64 %snext)
+  ret i32 0
+}
+!0 = !{!"function_entry_count", i64 1}
+!1 = !{!"branch_weights", i32 11, i32 989}
+!2 = !{!"branch_weights", i32 999, i32 1}